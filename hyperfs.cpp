@@ -18,156 +18,600 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include <functional>
+#include <algorithm>
 #include <iostream>
 #include <string.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <chrono>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <fstream>
 
-#include "hyperfs.h"
+#include "hyperfs_def.h"
 
 namespace hfs
 {
-	const int32_t 							 ERR_WR_NO_DEF = -1; //NUL_WRF
-	const int32_t 							 ERR_RD_NO_DEF = -2; //NUL_RDF
-	const int32_t 						  ERR_RD_WR_NO_DEF = -3; //NUL_WRF
-	const int32_t			  ERR_HEADER_INVALID_DIRECTION = -4; //HED_DIR
-	const int32_t		   ERR_HEADER_INVALID_CLUSTER_INFO = -5; //HED_CIF
-	const int32_t			ERR_HEADER_UNSUPPORTED_VERSION = -6; //HED_VER
-	const int32_t		ERR_HEADER_NON_FF_RESERVED_SEGMENT = -7; //HED_RSF
-	const int32_t				  ERR_HEADER_ZERO_BOOT_SIG = -8; //HED_ZBS
-	// const int32_t		  ERR_HEADER_PADDING_TOO_SHORT = -9; // INVALID! Would cause HED_ZBS
-	const int32_t			 ERR_RFE_INVALID_PRESV_SEGMENT = -9; //RFE_PRS
-	const int32_t							ERR_RFE_NO_END = -10;//RFE_NED
-	const int32_t						 ERR_DATA_NO_SPACE = -11;//DTA_NSP
-	const int32_t					   ERR_FILE_NOT_LOCKED = -12;//FIL_NLK
-	const int32_t				 ERR_FILE_BUFFER_TOO_LARGE = -13;//FIL_BTL
-	const int32_t				  ERR_FILE_DEPTH_TOO_LARGE = -14;//FIL_DTL
-
-	const uint8_t HFS_SEEK_SET = 0;
-	const uint8_t HFS_SEEK_CUR = 1;
-	const uint8_t HFS_SEEK_END = 2;
-
-	struct date
-	{
-		date()
-		{
-			year = 0;
-			month = day = 0;
-		}
-	
-		date(uint16_t compact)
-		{
-			year = ((compact >> 7) & 0x007F) + 2024;
-			month = ((compact >> 5) & 0x000F) + 1;
-			day = compact & 0x001F;
-		}
-	
-		uint16_t year;
-		uint8_t month;
-		uint8_t day;
-	};
-
 	uint16_t create_date_16()
 	{
 		std::time_t t = std::time(0);
-		std::tm* now = std::localtime(&t);
-		return ((now->tm_year - 124) << 7) | (now->tm_mon << 5) | (now->tm_mday);
+		std::tm now;
+		localtime_r(&t, &now); // std::localtime reloads the time zone (allocating) on every call
+		return ((now.tm_year - 124) << 7) | (now.tm_mon << 5) | (now.tm_mday);
+	}
+
+	// CRC32C (Castagnoli, reflected 0x82F63B78), crc is the value returned by the previous call or 0 to start. crc32c("123456789") is 0xE3069283.
+	struct crc32c_table
+	{
+		uint32_t t[8][256];
+
+		crc32c_table()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+				t[0][i] = c;
+			}
+			for (uint32_t i = 0; i < 256; i++)
+				for (int s = 1; s < 8; s++)
+					t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+		}
+	};
+
+	// Slicing by 8, used when the CPU has no crc32 instruction
+	uint32_t crc32c_sw(uint32_t crc, const void* data, size_t size)
+	{
+		static const crc32c_table table;
+		const uint8_t* p = (const uint8_t*)data;
+		crc = ~crc;
+		for (; size >= 8; size -= 8, p += 8)
+		{
+			uint64_t v = 0;
+			memcpy(&v, p, sizeof(v));
+			v ^= crc;
+			crc = table.t[7][v & 0xFF] ^ table.t[6][(v >> 8) & 0xFF] ^ table.t[5][(v >> 16) & 0xFF] ^ table.t[4][(v >> 24) & 0xFF] ^
+				table.t[3][(v >> 32) & 0xFF] ^ table.t[2][(v >> 40) & 0xFF] ^ table.t[1][(v >> 48) & 0xFF] ^ table.t[0][v >> 56];
+		}
+		for (; size > 0; size--, p++)
+			crc = (crc >> 8) ^ table.t[0][(crc ^ *p) & 0xFF];
+		return ~crc;
+	}
+
+#if defined(__x86_64__)
+	__attribute__((target("sse4.2")))
+	uint32_t crc32c_hw(uint32_t crc, const void* data, size_t size)
+	{
+		const uint8_t* p = (const uint8_t*)data;
+		uint64_t c = ~crc;
+		for (; size >= 8; size -= 8, p += 8)
+		{
+			uint64_t v = 0;
+			memcpy(&v, p, sizeof(v));
+			c = __builtin_ia32_crc32di(c, v);
+		}
+		uint32_t c32 = c;
+		for (; size > 0; size--, p++)
+			c32 = __builtin_ia32_crc32qi(c32, *p);
+		return ~c32;
 	}
+#endif
 
-	struct hfs_object
+	uint32_t crc32c(uint32_t crc, const void* data, size_t size)
 	{
-		std::function<size_t(void*, size_t, size_t, void*)> read_fn; //new_pos, buffer, size, position, extra_args (checks if size is zero and returns current position (ftell))
-		std::function<size_t(void*, size_t, size_t, void*)> write_fn;//new_pos, buffer, size, position, extra_args (overwrite) (checks if size is zero and goes to position without writing (fseek) with the seek_set/seek_cur/seek_end, being contained in the buffer as an uint8_t*)
-		std::function<void(void*)> reset_file_fn; // extra_args, truncates file
-	
-		void* extra_args;
-		hfs_header header;
-		std::vector<hfs_reserved_file_entry> rfe;
-		std::vector<uint64_t> lock_rfe;
-		size_t position;
+#if defined(__x86_64__)
+		static const int has_sse42 = __builtin_cpu_supports("sse4.2");
+		if (has_sse42)
+			return crc32c_hw(crc, data, size);
+#endif
+		return crc32c_sw(crc, data, size);
+	}
+
+	const uint64_t CMAP_FREE = 0;
+	const uint64_t CMAP_PINNED = 1;
+	const uint64_t CMAP_RFE = (uint64_t)1 << 63;
 
-		int no_read = false;
-		int bootable = false;
+	const uint64_t DEFRAG_RUN_BYTES = 0x100000; // Most defrag copies with a single read/write, always at least one cluster
 
-		void read(void* buffer, size_t size)
+	hfs_rfe_table::hfs_rfe_table()
+	{
+	}
+	hfs_rfe_table::~hfs_rfe_table()
+	{
+		release();
+	}
+	hfs_reserved_file_entry& hfs_rfe_table::operator[](uint64_t index)
+	{
+		return blocks[index / RFE_TABLE_BLOCK]->entries[index % RFE_TABLE_BLOCK];
+	}
+	uint64_t& hfs_rfe_table::offset(uint64_t index)
+	{
+		return blocks[index / RFE_TABLE_BLOCK]->offsets[index % RFE_TABLE_BLOCK];
+	}
+	uint64_t hfs_rfe_table::size()
+	{
+		return count;
+	}
+	void hfs_rfe_table::clear()
+	{
+		count = 0;
+	}
+	void hfs_rfe_table::push_back(const hfs_reserved_file_entry& h_rfe, uint64_t offset)
+	{
+		if (count == blocks.size() * RFE_TABLE_BLOCK)
 		{
-			position = read_fn(buffer, size, position, extra_args);
+			hfs_rfe_block* block = (hfs_rfe_block*)malloc(sizeof(hfs_rfe_block));
+			memset(block->locked, 0, RFE_TABLE_BLOCK);
+			blocks.push_back(block);
 		}
-		void write(void* buffer, size_t size)
+		this->offset(count) = offset;
+		(*this)[count++] = h_rfe;
+	}
+	int hfs_rfe_table::is_locked(uint64_t index)
+	{
+		if (index >= blocks.size() * RFE_TABLE_BLOCK)
+			return 0;
+		return blocks[index / RFE_TABLE_BLOCK]->locked[index % RFE_TABLE_BLOCK];
+	}
+	void hfs_rfe_table::set_locked(uint64_t index, int val)
+	{
+		blocks[index / RFE_TABLE_BLOCK]->locked[index % RFE_TABLE_BLOCK] = val;
+	}
+	void hfs_rfe_table::release()
+	{
+		for (hfs_rfe_block* block : blocks)
+			free(block);
+		blocks.clear();
+		count = 0;
+	}
+
+	void hfs_object::enter(uint8_t api, uint64_t user_bytes)
+	{
+		if (api_fn)
+			api_fn(api, user_bytes, extra_args);
+	}
+
+	void hfs_object::read(void* buffer, size_t size)
+	{
+		io_bytes += size;
+		position = read_fn(buffer, size, position, extra_args);
+	}
+
+	void hfs_object::write(void* buffer, size_t size)
+	{
+		io_bytes += size;
+		position = write_fn(buffer, size, position, extra_args);
+	}
+
+	size_t hfs_object::ftell()
+	{
+		return read_fn(nullptr, 0, 0, extra_args);
+	}
+
+	size_t hfs_object::fseek(size_t pos, uint8_t mode)
+	{
+		return position = write_fn((void*)&mode, 0, pos, extra_args);
+	}
+
+	int32_t hfs_object::init()
+	{
+		if (!read_fn && !write_fn)
+			return ERR_RD_WR_NO_DEF;
+		if (!read_fn)
+			return ERR_RD_NO_DEF;
+		if (!write_fn)
+			return ERR_WR_NO_DEF;
+
+		memset(&header, 0, HEADER_SIZE);
+		header.c_pad = nullptr;
+		c_buff = nullptr;
+		c_buff_size = 0;
+		return 0;
+	}
+
+	int hfs_object::uninit()
+	{
+		if (header.c_pad != 0)
+			free(header.c_pad);
+		header.c_pad = nullptr;
+		if (c_buff != nullptr)
+			free(c_buff);
+		c_buff = nullptr;
+		c_buff_size = 0;
+		rfe.release();
+		defrag_state = hfs_defrag_state();
+		return 0;
+	}
+
+	int32_t hfs_object::parse()
+	{
+		enter(HFS_API_PARSE, 0);
+		fseek(0, HFS_SEEK_SET);
+		read(&header, HEADER_SIZE);
+		if (header.boot_sig_0 == 0 || header.boot_sig_1 == 0)
+			return ERR_HEADER_ZERO_BOOT_SIG;
+		if (header.boot_sig_0 == 0x55 && header.boot_sig_1 == 0xAA)
+			bootable = true;
+
+		if (header.direction_b01 == 0xAA && header.direction_b10 == 0x55)
 		{
-			position = write_fn(buffer, size, position, extra_args);
+			if (header.signature == HEADER_NOREAD_LSB_SIGNATURE)
+				no_read = true;
 		}
-		size_t ftell()
+		else if (header.direction_b01 == 0x55 && header.direction_b10 == 0xAA)
 		{
-			return read_fn(nullptr, 0, 0, extra_args);
+			if (header.signature == HEADER_NOREAD_SIGNATURE)
+				no_read = true;
 		}
-		size_t fseek(size_t pos, uint8_t mode)
+		else if (header.direction_b01 == 0 || header.direction_b10 == 0)
+		{
+				return ERR_HEADER_INVALID_DIRECTION;
+			}
+
+		if (((header.cluster_size % CLUSTER_MULTIPLIER) > 0) || (header.clusters_available != 0 && header.cluster_to_be_allocated != 0 && (header.cluster_to_be_allocated + header.clusters_available != header.clusters)))
+			return ERR_HEADER_INVALID_CLUSTER_INFO;
+		uint8_t version = header.attribute & 0b00000011;
+		if (version > HEADER_VERSION_1)
+			return ERR_HEADER_UNSUPPORTED_VERSION;
+		if (version == HEADER_VERSION_0 && header.reserved != 0xFF)
+			return ERR_HEADER_NON_FF_RESERVED_SEGMENT;
+		if (version == HEADER_VERSION_1 && (header.reserved & ~HEADER_FEATURES_SUPPORTED))
+			return ERR_HEADER_UNSUPPORTED_FEATURE;
+		// Version 0 volumes predate the limit and are still opened, their big clusters just can't be filled past a 16 bit used_bytes.
+		if (version == HEADER_VERSION_1 && !has_feature(HEADER_FEATURE_WIDE_CLUSTER) && header.cluster_size > CLUSTER_NARROW_MAX)
+			return ERR_HEADER_INVALID_CLUSTER_INFO;
+		if (has_feature(HEADER_FEATURE_CHECKSUM) && header.checksum != header_checksum())
+			return ERR_CLUSTER_CHECKSUM;
+		alloc_scratch();
+		defrag_state.valid = false;
+		return 0;
+	}
+
+	int hfs_object::has_feature(uint8_t feature)
+	{
+		return (header.attribute & 0b00000011) == HEADER_VERSION_1 && (header.reserved & feature);
+	}
+
+	void hfs_object::alloc_scratch()
+	{
+		if (c_buff && c_buff_size == header.cluster_size)
+			return;
+		if (c_buff)
+			free(c_buff);
+		c_buff = (uint8_t*)malloc(header.cluster_size);
+		c_buff_size = header.cluster_size;
+	}
+
+	uint32_t hfs_object::header_checksum()
+	{
+		uint64_t offset = offsetof(hfs_header, checksum);
+		return crc32c(crc32c(0, &header, offset), (uint8_t*)&header + offset + sizeof(header.checksum), HEADER_SIZE - offset - sizeof(header.checksum));
+	}
+
+	void hfs_object::write_header()
+	{
+		layout_gen++;
+		if (has_feature(HEADER_FEATURE_CHECKSUM))
+			header.checksum = header_checksum();
+		fseek(0, HFS_SEEK_SET);
+		write(&header, HEADER_SIZE);
+	}
+
+	// Bytes at the end of every data cluster used by the checksums, used_bytes and next_cluster
+	uint64_t hfs_object::trailer_size()
+	{
+		uint64_t t_size = sizeof(uint16_t) + CLUSTER_CHAIN_SIZE;
+		if (has_feature(HEADER_FEATURE_WIDE_CLUSTER))
+			t_size = sizeof(uint64_t) + CLUSTER_CHAIN_SIZE;
+		if (has_feature(HEADER_FEATURE_CHECKSUM))
+			t_size += checksum_blocks() * sizeof(uint32_t);
+		return t_size;
+	}
+
+	uint64_t hfs_object::used_bytes_offset()
+	{
+		return header.cluster_size - CLUSTER_CHAIN_SIZE - (has_feature(HEADER_FEATURE_WIDE_CLUSTER) ? sizeof(uint64_t) : sizeof(uint16_t));
+	}
+
+	// The hfs_reserved_chain_entry of an RFE chain cluster, at the same offset with or without HEADER_FEATURE_CHECKSUM
+	uint64_t hfs_object::rce_offset()
+	{
+		return (header.cluster_size - 24)/40*40;
+	}
+
+	// With HEADER_FEATURE_CHECKSUM the last entry slots are taken by the block checksums
+	uint64_t hfs_object::rfes_per_cluster()
+	{
+		uint64_t slots = rce_offset()/40;
+		if (has_feature(HEADER_FEATURE_CHECKSUM))
+			slots -= (checksum_blocks() * sizeof(uint32_t) + 39)/40;
+		return slots;
+	}
+
+	// Reads/writes the used_bytes field of the trailer at the current position
+	uint64_t hfs_object::read_used_bytes()
+	{
+		if (has_feature(HEADER_FEATURE_WIDE_CLUSTER))
 		{
-			return position = write_fn((void*)&mode, 0, pos, extra_args);
+			uint64_t used_bytes = 0;
+			read(&used_bytes, sizeof(used_bytes));
+			return used_bytes;
 		}
+		uint16_t used_bytes = 0;
+		read(&used_bytes, sizeof(used_bytes));
+		return used_bytes;
+	}
 
-		int32_t init()
+	void hfs_object::write_used_bytes(uint64_t used_bytes)
+	{
+		if (has_feature(HEADER_FEATURE_WIDE_CLUSTER))
 		{
-			if (!read_fn && !write_fn)
-				return ERR_RD_WR_NO_DEF;
-			if (!read_fn)
-				return ERR_RD_NO_DEF;
-			if (!write_fn)
-				return ERR_WR_NO_DEF;
+			write(&used_bytes, sizeof(used_bytes));
+			return;
+		}
+		uint16_t n_used_bytes = used_bytes;
+		write(&n_used_bytes, sizeof(n_used_bytes));
+	}
 
-			memset(&header, 0, HEADER_SIZE);
-			header.c_pad = nullptr;
-			return 0;
+	// Same for a cluster held in memory
+	uint64_t hfs_object::get_used_bytes(uint8_t* buff)
+	{
+		if (has_feature(HEADER_FEATURE_WIDE_CLUSTER))
+		{
+			uint64_t used_bytes = 0;
+			memcpy(&used_bytes, buff + used_bytes_offset(), sizeof(used_bytes));
+			return used_bytes;
 		}
-		int uninit()
+		uint16_t used_bytes = 0;
+		memcpy(&used_bytes, buff + used_bytes_offset(), sizeof(used_bytes));
+		return used_bytes;
+	}
+
+	void hfs_object::set_used_bytes(uint8_t* buff, uint64_t used_bytes)
+	{
+		if (has_feature(HEADER_FEATURE_WIDE_CLUSTER))
 		{
-			if (header.c_pad != 0)
-				free(header.c_pad);
+			memcpy(buff + used_bytes_offset(), &used_bytes, sizeof(used_bytes));
+			return;
+		}
+		uint16_t n_used_bytes = used_bytes;
+		memcpy(buff + used_bytes_offset(), &n_used_bytes, sizeof(n_used_bytes));
+	}
+
+	uint64_t hfs_object::checksum_blocks()
+	{
+		return header.cluster_size / CHECKSUM_BLOCK_SIZE;
+	}
+
+	// Offset of the block checksum table. RFE chain clusters keep it in the entry slots before their hfs_reserved_chain_entry, data and inline clusters in the trailer.
+	uint64_t hfs_object::checksum_offset(int is_rfe)
+	{
+		if (is_rfe)
+			return rfes_per_cluster() * 40;
+		return header.cluster_size - trailer_size();
+	}
+
+	// CRC32C of a block of the cluster in buff, whatever part of the checksum table lies in the block is left out
+	uint32_t hfs_object::block_checksum(uint8_t* buff, uint64_t block, uint64_t table)
+	{
+		uint64_t start = block * CHECKSUM_BLOCK_SIZE;
+		uint64_t end = start + CHECKSUM_BLOCK_SIZE;
+		uint64_t t_start = std::min(std::max(table, start), end);
+		uint64_t t_end = std::min(std::max(table + checksum_blocks() * sizeof(uint32_t), start), end);
+		return crc32c(crc32c(0, buff + start, t_start - start), buff + t_end, end - t_end);
+	}
+
+	// Checks/sets the checksums of blocks first to last of a cluster held in memory, nothing to do without HEADER_FEATURE_CHECKSUM
+	int32_t hfs_object::verify_blocks(uint8_t* buff, int is_rfe, uint64_t first, uint64_t last)
+	{
+		if (!has_feature(HEADER_FEATURE_CHECKSUM))
 			return 0;
+		uint64_t table = checksum_offset(is_rfe);
+		for (uint64_t block = first; block <= last; block++)
+		{
+			uint32_t checksum = 0;
+			memcpy(&checksum, buff + table + block * sizeof(checksum), sizeof(checksum));
+			if (checksum != block_checksum(buff, block, table))
+				return ERR_CLUSTER_CHECKSUM;
 		}
-		int32_t parse()
+		return 0;
+	}
+
+	void hfs_object::seal_blocks(uint8_t* buff, int is_rfe, uint64_t first, uint64_t last)
+	{
+		if (!has_feature(HEADER_FEATURE_CHECKSUM))
+			return;
+		uint64_t table = checksum_offset(is_rfe);
+		for (uint64_t block = first; block <= last; block++)
 		{
-			fseek(0, HFS_SEEK_SET);
-			read(&header, HEADER_SIZE);
-			if (header.boot_sig_0 == 0 || header.boot_sig_1 == 0)
-				return ERR_HEADER_ZERO_BOOT_SIG;
-			if (header.boot_sig_0 == 0x55 && header.boot_sig_1 == 0xAA)
-				bootable = true;
+			uint32_t checksum = block_checksum(buff, block, table);
+			memcpy(buff + table + block * sizeof(checksum), &checksum, sizeof(checksum));
+		}
+	}
 
-			if (header.direction_b01 == 0xAA && header.direction_b10 == 0x55)
-			{
-				if (header.signature == HEADER_NOREAD_LSB_SIGNATURE)
-					no_read = true;
-			}
-			else if (header.direction_b01 == 0x55 && header.direction_b10 == 0xAA)
+	int32_t hfs_object::verify_cluster(uint8_t* buff, int is_rfe)
+	{
+		return verify_blocks(buff, is_rfe, 0, checksum_blocks() - 1);
+	}
+
+	void hfs_object::seal_cluster(uint8_t* buff, int is_rfe)
+	{
+		seal_blocks(buff, is_rfe, 0, checksum_blocks() - 1);
+	}
+
+	// Whole cluster I/O, verifying and updating the checksums with HEADER_FEATURE_CHECKSUM
+	int32_t hfs_object::read_cluster(uint64_t cluster, uint8_t* buff, int is_rfe)
+	{
+		fseek(cluster * header.cluster_size, HFS_SEEK_SET);
+		read(buff, header.cluster_size);
+		return verify_cluster(buff, is_rfe);
+	}
+
+	void hfs_object::write_cluster(uint64_t cluster, uint8_t* buff, int is_rfe)
+	{
+		seal_cluster(buff, is_rfe);
+		fseek(cluster * header.cluster_size, HFS_SEEK_SET);
+		write(buff, header.cluster_size);
+	}
+
+	// Reads the blocks holding [offset, offset + size) of a cluster into c_buff (at their place in the cluster) and verifies them against their checksums.
+	// With only_edges the blocks the range covers whole are left out, the caller is about to overwrite them.
+	int32_t hfs_object::load_blocks(uint64_t cluster, uint64_t offset, uint64_t size, int is_rfe, int only_edges)
+	{
+		uint64_t first = offset / CHECKSUM_BLOCK_SIZE;
+		uint64_t last = (offset + size - 1) / CHECKSUM_BLOCK_SIZE;
+		uint64_t table = checksum_offset(is_rfe);
+		uint64_t t_start = table + first * sizeof(uint32_t);
+		uint64_t t_end = table + (last + 1) * sizeof(uint32_t);
+		auto is_needed = [&](uint64_t block)
+		{
+			return !only_edges || block * CHECKSUM_BLOCK_SIZE < offset || (block + 1) * CHECKSUM_BLOCK_SIZE > offset + size;
+		};
+		// Runs of needed blocks are read with one call, the checksums separately unless a run already holds them
+		int has_table = false;
+		int is_any = false;
+		for (uint64_t block = first; block <= last;)
+		{
+			uint64_t end = block;
+			while (end <= last && is_needed(end))
+				end++;
+			if (end == block)
 			{
-				if (header.signature == HEADER_NOREAD_SIGNATURE)
-					no_read = true;
+				block++;
+				continue;
 			}
-			else if (header.direction_b01 == 0 || header.direction_b10 == 0)
-			{
-					return ERR_HEADER_INVALID_DIRECTION;
-				}
+			fseek(cluster * header.cluster_size + block * CHECKSUM_BLOCK_SIZE, HFS_SEEK_SET);
+			read(c_buff + block * CHECKSUM_BLOCK_SIZE, (end - block) * CHECKSUM_BLOCK_SIZE);
+			if (t_start >= block * CHECKSUM_BLOCK_SIZE && t_end <= end * CHECKSUM_BLOCK_SIZE)
+				has_table = true;
+			is_any = true;
+			block = end;
+		}
+		if (!is_any)
+			return 0;
+		if (!has_table)
+		{
+			fseek(cluster * header.cluster_size + t_start, HFS_SEEK_SET);
+			read(c_buff + t_start, t_end - t_start);
+		}
+		for (uint64_t block = first; block <= last; block++)
+		{
+			if (!is_needed(block))
+				continue;
+			int32_t vb_val = verify_blocks(c_buff, is_rfe, block, block);
+			if (vb_val < 0)
+				return vb_val;
+		}
+		return 0;
+	}
+
+	// Seals the blocks holding [offset, offset + size) in c_buff and writes them along with their checksums
+	void hfs_object::store_blocks(uint64_t cluster, uint64_t offset, uint64_t size, int is_rfe)
+	{
+		uint64_t first = offset / CHECKSUM_BLOCK_SIZE;
+		uint64_t last = (offset + size - 1) / CHECKSUM_BLOCK_SIZE;
+		uint64_t table = checksum_offset(is_rfe);
+		uint64_t t_start = table + first * sizeof(uint32_t);
+		uint64_t t_end = table + (last + 1) * sizeof(uint32_t);
+		seal_blocks(c_buff, is_rfe, first, last);
+		fseek(cluster * header.cluster_size + first * CHECKSUM_BLOCK_SIZE, HFS_SEEK_SET);
+		write(c_buff + first * CHECKSUM_BLOCK_SIZE, (last - first + 1) * CHECKSUM_BLOCK_SIZE);
+		if (t_start < first * CHECKSUM_BLOCK_SIZE || t_end > (last + 1) * CHECKSUM_BLOCK_SIZE)
+		{
+			fseek(cluster * header.cluster_size + t_start, HFS_SEEK_SET);
+			write(c_buff + t_start, t_end - t_start);
+		}
+	}
+
+	// Partial cluster I/O, with HEADER_FEATURE_CHECKSUM the blocks holding the range go through c_buff instead.
+	// The range must stay clear of the checksum table.
+	int32_t hfs_object::fetch_cluster(uint64_t cluster, uint64_t offset, void* buffer, uint64_t size, int is_rfe)
+	{
+		if (!has_feature(HEADER_FEATURE_CHECKSUM))
+		{
+			fseek(cluster * header.cluster_size + offset, HFS_SEEK_SET);
+			read(buffer, size);
+			return 0;
+		}
+		if (size == 0)
+			return 0;
+		int32_t lb_val = load_blocks(cluster, offset, size, is_rfe, false);
+		if (lb_val < 0)
+			return lb_val;
+		memcpy(buffer, c_buff + offset, size);
+		return 0;
+	}
 
-			if (((header.cluster_size % CLUSTER_MULTIPLIER) > 0) || (header.clusters_available != 0 && header.cluster_to_be_allocated != 0 && (header.cluster_to_be_allocated + header.clusters_available != header.clusters)))
-				return ERR_HEADER_INVALID_CLUSTER_INFO;
-			if (header.attribute & 0b00000011)
-				return ERR_HEADER_UNSUPPORTED_VERSION;
-			if (header.reserved != 0xFF)
-				return ERR_HEADER_NON_FF_RESERVED_SEGMENT;
+	int32_t hfs_object::patch_cluster(uint64_t cluster, uint64_t offset, void* buffer, uint64_t size, int is_rfe)
+	{
+		if (!has_feature(HEADER_FEATURE_CHECKSUM))
+		{
+			fseek(cluster * header.cluster_size + offset, HFS_SEEK_SET);
+			write(buffer, size);
+			return 0;
+		}
+		if (size == 0)
 			return 0;
+		int32_t lb_val = load_blocks(cluster, offset, size, is_rfe, true);
+		if (lb_val < 0)
+			return lb_val;
+		memcpy(c_buff + offset, buffer, size);
+		store_blocks(cluster, offset, size, is_rfe);
+		return 0;
+	}
+
+	// Writes a just allocated data cluster, whatever it contained before is ignored. With HEADER_FEATURE_CHECKSUM all of it is written so every block has a valid checksum.
+	void hfs_object::write_new_cluster(uint64_t cluster, void* buffer, uint64_t size, uint64_t used_bytes)
+	{
+		uint64_t n_cluster = CLUSTER_END;
+		if (has_feature(HEADER_FEATURE_CHECKSUM))
+		{
+			memset(c_buff, 0, header.cluster_size);
+			if (size)
+				memcpy(c_buff, buffer, size);
+			set_used_bytes(c_buff, used_bytes);
+			memcpy(c_buff + header.cluster_size - CLUSTER_CHAIN_SIZE, &n_cluster, sizeof(n_cluster));
+			write_cluster(cluster, c_buff, false);
+			return;
+		}
+		if (size)
+		{
+			fseek(cluster * header.cluster_size, HFS_SEEK_SET);
+			write(buffer, size);
 		}
-		int32_t read_rfe_chain()
+		fseek(cluster * header.cluster_size + used_bytes_offset(), HFS_SEEK_SET);
+		write_used_bytes(used_bytes);
+		write(&n_cluster, sizeof(n_cluster));
+	}
+
+	int32_t hfs_object::read_rfe_chain()
+	{
+		rfe.clear();
+		uint64_t num_of_rfes_per_cluster = rfes_per_cluster();
+		if (!has_feature(HEADER_FEATURE_CHECKSUM))
 		{
-			rfe.clear();
 			hfs_reserved_file_entry h_rfe;
-			fseek(header.cluster_size, SEEK_SET);
-			uint64_t num_of_rfes_per_cluster = (header.cluster_size - 24)/40;
+			h_rfe.is_last_rfe = 0;
+			uint64_t pos = header.cluster_size;
+			fseek(pos, HFS_SEEK_SET);
 			uint64_t index = 0;
 			while (!h_rfe.is_last_rfe)
 			{
+				if (index == num_of_rfes_per_cluster)
+				{
+					hfs_reserved_chain_entry rce;
+					read(&rce, sizeof(rce));
+					if (rce.next_rfe_chain <= CLUSTER_END_NUB)
+						return 0;
+					pos = rce.next_rfe_chain * header.cluster_size;
+					fseek(pos, HFS_SEEK_SET);
+					index = 0;
+					continue;
+				}
 				read(&h_rfe, sizeof(h_rfe));
 				uint8_t process_pr = h_rfe.p_resv & 0b01111111;
 				if (process_pr != 0b00111111 && process_pr != 0b00111110)
@@ -177,446 +621,1638 @@ namespace hfs
 					rfe.clear();
 					return ERR_RFE_NO_END;
 				}
-				if (index == num_of_rfes_per_cluster)
+				if (process_pr == 0b00111111)
+					rfe.push_back(h_rfe, pos);
+				pos += sizeof(h_rfe);
+				index++;
+			}
+			return 0;
+		}
+		// With HEADER_FEATURE_CHECKSUM the chain is read a cluster at a time so every cluster can be verified
+		uint64_t cluster = 1;
+		while (true)
+		{
+			int32_t rc_val = read_cluster(cluster, c_buff, true);
+			if (rc_val < 0)
+				return rc_val;
+			for (uint64_t index = 0; index < num_of_rfes_per_cluster; index++)
+			{
+				hfs_reserved_file_entry* h_rfe = (hfs_reserved_file_entry*)(c_buff + index * 40);
+				uint8_t process_pr = h_rfe->p_resv & 0b01111111;
+				if (process_pr != 0b00111111 && process_pr != 0b00111110)
 				{
-					hfs_reserved_chain_entry rce;
-					read(&rce, sizeof(rce));
-					if (rce.next_rfe_chain == CLUSTER_END)
+					if (rfe.size() == 0)
 						return 0;
-					else
-					{
-						fseek(rce.next_rfe_chain * header.cluster_size, SEEK_SET);
-						continue;
-					}
+					rfe.clear();
+					return ERR_RFE_NO_END;
 				}
 				if (process_pr == 0b00111111)
-					rfe.push_back(h_rfe);
-				index++;
+					rfe.push_back(*h_rfe, cluster * header.cluster_size + index * 40);
+				if (h_rfe->is_last_rfe)
+					return 0;
 			}
-			return 0;
+			hfs_reserved_chain_entry* rce = (hfs_reserved_chain_entry*)(c_buff + rce_offset());
+			if (rce->next_rfe_chain <= CLUSTER_END_NUB)
+				return 0;
+			cluster = rce->next_rfe_chain;
 		}
-		int32_t write_rfe_chain()
+	}
+
+	// Rewrites the whole RFE chain, dropping deleted entries
+	int32_t hfs_object::write_rfe_chain()
+	{
+		layout_gen++;
+		uint64_t num_of_rfes_per_cluster = rfes_per_cluster();
+		if (!has_feature(HEADER_FEATURE_CHECKSUM))
 		{
-			fseek(header.cluster_size, SEEK_SET);
-			uint64_t num_of_rfes_per_cluster = (header.cluster_size - 24)/40;
+			uint64_t pos = header.cluster_size;
+			fseek(pos, HFS_SEEK_SET);
 			uint64_t index = 0;
-			uint64_t t_index = 0;
-			while (true)
+			for (size_t t_index = 0; t_index < rfe.size(); t_index++)
 			{
-				write(&rfe[t_index], sizeof(hfs_reserved_file_entry));
-				if (rfe[t_index].is_last_rfe)
-					break;
-				t_index++;
 				if (index == num_of_rfes_per_cluster)
 				{
-					size_t p = ftell();
 					hfs_reserved_chain_entry rce;
 					read(&rce, sizeof(rce));
 					if (rce.next_rfe_chain <= CLUSTER_END_NUB)
 					{
+						if (header.clusters_available == 0 || header.cluster_to_be_allocated == 0)
+							return ERR_DATA_NO_SPACE;
 						rce.next_rfe_chain = header.cluster_to_be_allocated;
 						header.cluster_to_be_allocated++;
 						header.clusters_available--;
-						fseek(0, SEEK_SET);
-						write(&header, HEADER_SIZE);
-						fseek(p, SEEK_SET);
+						write_header();
+						// The new cluster may hold leftovers (defrag scratch), its chain entry has to end the chain
+						hfs_reserved_chain_entry n_rce;
+						memset(&n_rce, 0, sizeof(n_rce));
+						fseek(rce.next_rfe_chain * header.cluster_size + rce_offset(), HFS_SEEK_SET);
+						write(&n_rce, sizeof(n_rce));
+						fseek(pos, HFS_SEEK_SET);
 						write(&rce, sizeof(rce));
-						fseek(rce.next_rfe_chain * header.cluster_size, SEEK_SET);
-						continue;
-					}
-					fseek(rce.next_rfe_chain * header.cluster_size, SEEK_SET);
-					if (rfe[t_index - 1].is_last_rfe)
-					{
-						hfs_reserved_file_entry rf;
-						memset(&rf, 0, sizeof(rf));
-						write(&rf, sizeof(rf));
-						break;
 					}
+					pos = rce.next_rfe_chain * header.cluster_size;
+					fseek(pos, HFS_SEEK_SET);
 					index = 0;
-					continue;
 				}
+				rfe[t_index].is_last_rfe = t_index == rfe.size() - 1;
+				rfe.offset(t_index) = pos;
+				write(&rfe[t_index], sizeof(hfs_reserved_file_entry));
+				pos += sizeof(hfs_reserved_file_entry);
 				index++;
 			}
 			return 0;
 		}
-		int format(uint64_t cluster_size, uint64_t clusters, uint32_t signature, uint8_t* name, uint8_t attributes, uint8_t owner_id, uint8_t boot_sig_0, uint8_t boot_sig_1, uint8_t lname_len, uint8_t* lname) // name is 12 bytes
-		{
-			fseek(0, HFS_SEEK_SET);
-			reset_file_fn(extra_args);
-			header.signature = signature;
-			header.direction_b01 = 0xAA;
-			header.direction_b10 = 0x55;
-			header.cluster_to_be_allocated = 0x2;
-			header.cluster_size = cluster_size;
-			header.clusters_available = clusters - 2;
-			memcpy(header.name, name, 12);
-			header.attribute = attributes;
-			header.creation_date = create_date_16();
-			header.owner_id = owner_id;
-			header.reserved = 0xFF;
-			header.clusters = clusters;
-			memset(header.padding, 0, HEADER_PADDING_SIZE);
-			if (lname_len > 0 && attributes & 0b10000000)
-			{
-				header.padding[0] = lname_len;
-				for (int i = 0; i < lname_len; i++)
-				{
-					header.padding[i + 1] = lname[i];
-				}
-			}
-			header.boot_sig_0 = boot_sig_0;
-			header.boot_sig_1 = boot_sig_1;
-			uint64_t c_pad_size = cluster_size - 512;
-			header.c_pad = (uint8_t*)malloc(c_pad_size);
-			memset(header.c_pad, 0, c_pad_size);
-			void* zbuff = malloc(cluster_size);
-			memset(zbuff, 0, cluster_size);
-			for (uint64_t i = 0; i < clusters; i++)
-			{
-				write(zbuff, cluster_size);
-			}
-			free(zbuff);
-			fseek(0, HFS_SEEK_SET);
-			write(&header, HEADER_SIZE);
-			return 0;
-		}
-		int32_t add_file(uint8_t* name, uint8_t* extention, uint8_t attribute, uint8_t owner_id)
+		uint64_t cluster = 1;
+		size_t t_index = 0;
+		int32_t rc_val = read_cluster(cluster, c_buff, true);
+		if (rc_val < 0)
+			return rc_val;
+		while (true)
 		{
-			if (header.clusters_available == 0 || header.cluster_to_be_allocated == 0)
+			for (uint64_t index = 0; index < num_of_rfes_per_cluster && t_index < rfe.size(); index++, t_index++)
 			{
-				return ERR_DATA_NO_SPACE;
+				rfe[t_index].is_last_rfe = t_index == rfe.size() - 1;
+				rfe.offset(t_index) = cluster * header.cluster_size + index * 40;
+				memcpy(c_buff + index * 40, &rfe[t_index], sizeof(hfs_reserved_file_entry));
 			}
-			hfs_reserved_file_entry h_rfe;
-			memcpy(h_rfe.name, name, 12);
-			memcpy(h_rfe.extention, extention, 4);
-			h_rfe.attribute = attribute;
-			h_rfe.p_resv = 0x3F;
-			h_rfe.cluster_size = 1;
-			h_rfe.modification_date = h_rfe.creation_date = create_date_16();
-			h_rfe.owner_id = owner_id;
-			h_rfe.is_last_rfe = 1;
-			h_rfe.next_cluster = header.cluster_to_be_allocated;
-			header.cluster_to_be_allocated++;
-			header.clusters_available--;
-			fseek(0, SEEK_SET);
-			write(&header, HEADER_SIZE);
-			fseek((header.cluster_size * (h_rfe.next_cluster)) - 10, HFS_SEEK_SET);
-			uint64_t n_cluster = CLUSTER_END;
-			uint16_t u_bytes = 0;
-			write(&u_bytes, sizeof(u_bytes));
-			write(&n_cluster, sizeof(n_cluster));
-			int32_t rrc_val = read_rfe_chain();
-			if (rrc_val < 0)
+			hfs_reserved_chain_entry* rce = (hfs_reserved_chain_entry*)(c_buff + rce_offset());
+			uint64_t n_cluster = rce->next_rfe_chain;
+			int is_new = false;
+			if (t_index < rfe.size() && n_cluster <= CLUSTER_END_NUB)
 			{
-				return rrc_val;
+				if (header.clusters_available == 0 || header.cluster_to_be_allocated == 0)
+					return ERR_DATA_NO_SPACE;
+				n_cluster = rce->next_rfe_chain = header.cluster_to_be_allocated;
+				header.cluster_to_be_allocated++;
+				header.clusters_available--;
+				write_header();
+				is_new = true;
 			}
-			rfe.push_back(h_rfe);
-			return write_rfe_chain();
-		}
-		// Returns 0 when failed.
-		uint64_t lock_file(uint8_t* name, uint8_t* extention)
-		{
-			if (read_rfe_chain() < 0)
+			write_cluster(cluster, c_buff, true);
+			if (t_index >= rfe.size())
 				return 0;
-			uint64_t index = 0;
-			for (hfs_reserved_file_entry h_rfe : rfe)
+			cluster = n_cluster;
+			if (is_new)
+				memset(c_buff, 0, header.cluster_size);
+			else
 			{
-				if (memcmp(h_rfe.name, name, 12) || memcmp(h_rfe.extention, extention, 4))
-				{
-					index++;
-					continue;
-				}
-				if (lock_rfe.size() > 0)
-				{
-					for (uint64_t l_rfe : lock_rfe)
-					{
-						if (l_rfe == index)
-							return 0;
-					}
-				}
+				rc_val = read_cluster(cluster, c_buff, true);
+				if (rc_val < 0)
+					return rc_val;
 			}
-			lock_rfe.push_back(index);
-			return index + 1;
 		}
-		int32_t unlock_file(uint64_t fptr)
-		{
-			fptr--;
-			for (size_t i = 0; i < lock_rfe.size(); i++)
-			{
-				if (lock_rfe[i] == fptr)
+	}
+
+	// Writes back a single entry of the table (index is fptr - 1), only its own RFE cluster is touched
+	int32_t hfs_object::write_rfe(uint64_t index)
+	{
+		uint64_t offset = rfe.offset(index);
+		return patch_cluster(offset / header.cluster_size, offset % header.cluster_size, &rfe[index], sizeof(hfs_reserved_file_entry), true);
+	}
+
+	// name is 12 bytes, features are HEADER_FEATURE_* flags (formats a version 1 volume)
+	int hfs_object::format(uint64_t cluster_size, uint64_t clusters, uint32_t signature, uint8_t* name, uint8_t attributes, uint8_t owner_id, uint8_t boot_sig_0, uint8_t boot_sig_1, uint8_t lname_len, uint8_t* lname, uint8_t features)
+	{
+		enter(HFS_API_FORMAT, 0);
+		if (!(features & HEADER_FEATURE_WIDE_CLUSTER) && cluster_size > CLUSTER_NARROW_MAX)
+			return ERR_HEADER_INVALID_CLUSTER_INFO;
+		fseek(0, HFS_SEEK_SET);
+		reset_file_fn(extra_args);
+		header.signature = signature;
+		header.direction_b01 = 0xAA;
+		header.direction_b10 = 0x55;
+		header.cluster_to_be_allocated = 0x2;
+		header.cluster_size = cluster_size;
+		header.clusters_available = clusters - 2;
+		memcpy(header.name, name, 12);
+		header.attribute = attributes;
+		header.creation_date = create_date_16();
+		header.owner_id = owner_id;
+		header.reserved = 0xFF;
+		if (features)
+		{
+			header.attribute = (attributes & 0b11111100) | HEADER_VERSION_1;
+			header.reserved = features;
+		}
+		header.clusters = clusters;
+		memset(header.padding, 0, HEADER_PADDING_SIZE);
+		header.inline_cluster = CLUSTER_END;
+		header.inline_used = 0;
+		header.inline_free = CLUSTER_END;
+		if (lname_len > 0 && attributes & 0b10000000)
+		{
+			header.padding[0] = lname_len;
+			for (int i = 0; i < lname_len; i++)
+			{
+				header.padding[i + 1] = lname[i];
+			}
+		}
+		header.boot_sig_0 = boot_sig_0;
+		header.boot_sig_1 = boot_sig_1;
+		uint64_t c_pad_size = cluster_size - 512;
+		if (header.c_pad != 0)
+			free(header.c_pad);
+		header.c_pad = (uint8_t*)malloc(c_pad_size);
+		memset(header.c_pad, 0, c_pad_size);
+		alloc_scratch();
+		memset(c_buff, 0, cluster_size);
+		for (uint64_t i = 0; i < clusters; i++)
+		{
+			write(c_buff, cluster_size);
+		}
+		// The empty RFE chain has to carry a valid checksum too
+		if (has_feature(HEADER_FEATURE_CHECKSUM))
+			write_cluster(1, c_buff, true);
+		write_header();
+		return 0;
+	}
+
+	int32_t hfs_object::add_file(uint8_t* name, uint8_t* extention, uint8_t attribute, uint8_t owner_id)
+	{
+		enter(HFS_API_ADD_FILE, 0);
+		// Files without a long name start out empty and inline, they only take space once written to.
+		int is_inline = has_feature(HEADER_FEATURE_INLINE) && !(attribute & 0b10000000);
+		if (!is_inline && (header.clusters_available == 0 || header.cluster_to_be_allocated == 0))
+		{
+			return ERR_DATA_NO_SPACE;
+		}
+		hfs_reserved_file_entry h_rfe;
+		memcpy(h_rfe.name, name, 12);
+		memcpy(h_rfe.extention, extention, 4);
+		h_rfe.attribute = attribute;
+		h_rfe.p_resv = 0x3F;
+		h_rfe.cluster_size = 1;
+		h_rfe.modification_date = h_rfe.creation_date = create_date_16();
+		h_rfe.owner_id = owner_id;
+		h_rfe.is_last_rfe = 1;
+		if (is_inline)
+		{
+			h_rfe.cluster_size = 0;
+			h_rfe.next_cluster = CLUSTER_END;
+			int32_t rrc_val = read_rfe_chain();
+			if (rrc_val < 0)
+				return rrc_val;
+			rfe.push_back(h_rfe, 0);
+			return write_rfe_chain();
+		}
+		h_rfe.next_cluster = header.cluster_to_be_allocated;
+		header.cluster_to_be_allocated++;
+		header.clusters_available--;
+		write_header();
+		write_new_cluster(h_rfe.next_cluster, nullptr, 0, 0);
+		int32_t rrc_val = read_rfe_chain();
+		if (rrc_val < 0)
+		{
+			return rrc_val;
+		}
+		rfe.push_back(h_rfe, 0);
+		return write_rfe_chain();
+	}
+
+	// Returns 0 when failed.
+	uint64_t hfs_object::lock_file(uint8_t* name, uint8_t* extention)
+	{
+		enter(HFS_API_LOCK_FILE, 0);
+		if (read_rfe_chain() < 0)
+			return 0;
+		for (uint64_t index = 0; index < rfe.size(); index++)
+		{
+			hfs_reserved_file_entry& h_rfe = rfe[index];
+			if (memcmp(h_rfe.name, name, 12) || memcmp(h_rfe.extention, extention, 4))
+				continue;
+			if (rfe.is_locked(index))
+				return 0;
+			rfe.set_locked(index, true);
+			return index + 1;
+		}
+		return 0;
+	}
+
+	int32_t hfs_object::unlock_file(uint64_t fptr)
+	{
+		fptr--;
+		if (!rfe.is_locked(fptr))
+			return ERR_FILE_NOT_LOCKED;
+		rfe.set_locked(fptr, false);
+		return 0;
+	}
+
+	int hfs_object::is_locked(uint64_t fptr)
+	{
+		return rfe.is_locked(fptr);
+	}
+
+	// Reserves an inline record with at least capacity bytes of payload and returns its byte offset, CLUSTER_END when out of space.
+	// The first INLINE_FREE_SCAN freed records are tried first, capacity is set to the capacity of the record that was taken.
+	uint64_t hfs_object::alloc_inline(uint16_t& capacity)
+	{
+		uint64_t prev = CLUSTER_END;
+		uint64_t f_offset = header.inline_free;
+		for (uint64_t i = 0; i < INLINE_FREE_SCAN && f_offset != CLUSTER_END; i++)
+		{
+			uint8_t f_record[INLINE_RECORD_HEADER_SIZE + sizeof(uint64_t)];
+			hfs_inline_record* f_rec = (hfs_inline_record*)f_record;
+			if (fetch_cluster(f_offset / header.cluster_size, f_offset % header.cluster_size, f_record, sizeof(f_record), false) < 0 || f_rec->used_bytes != INLINE_RECORD_FREE)
+				break;
+			uint64_t next = 0;
+			memcpy(&next, f_record + INLINE_RECORD_HEADER_SIZE, sizeof(next));
+			if (f_rec->capacity >= capacity)
+			{
+				if (prev == CLUSTER_END)
 				{
-					lock_rfe.erase(lock_rfe.begin() + i);
-					return 0;
+					header.inline_free = next;
+					write_header();
 				}
+				else if (patch_cluster(prev / header.cluster_size, prev % header.cluster_size + INLINE_RECORD_HEADER_SIZE, &next, sizeof(next), false) < 0)
+					break;
+				capacity = f_rec->capacity;
+				return f_offset;
 			}
-			return ERR_FILE_NOT_LOCKED;
+			prev = f_offset;
+			f_offset = next;
 		}
-		int is_locked(uint64_t fptr)
+		uint64_t r_size = INLINE_RECORD_HEADER_SIZE + capacity;
+		if (header.inline_cluster == CLUSTER_END || header.inline_used + r_size > header.cluster_size - trailer_size())
 		{
-			for (size_t i = 0; i < lock_rfe.size(); i++)
+			if (header.clusters_available == 0 || header.cluster_to_be_allocated == 0)
+				return CLUSTER_END;
+			header.inline_cluster = header.cluster_to_be_allocated;
+			header.inline_used = 0;
+			header.cluster_to_be_allocated++;
+			header.clusters_available--;
+			if (has_feature(HEADER_FEATURE_CHECKSUM))
 			{
-				if (lock_rfe[i] == fptr)
-					return 1;
+				memset(c_buff, 0, header.cluster_size);
+				write_cluster(header.inline_cluster, c_buff, false);
 			}
+		}
+		uint64_t offset = header.inline_cluster * header.cluster_size + header.inline_used;
+		header.inline_used += r_size;
+		write_header();
+		return offset;
+	}
+
+	// Returns 1 if the record at offset is the last one taken from inline_cluster.
+	int hfs_object::is_inline_tail(uint64_t offset, uint16_t capacity)
+	{
+		return offset / header.cluster_size == header.inline_cluster && offset % header.cluster_size + INLINE_RECORD_HEADER_SIZE + capacity == header.inline_used;
+	}
+
+	// Gives a record back, the last record of inline_cluster is handed back to it and any other goes on the inline_free list.
+	// Records from before the list existed that can't hold the link (capacity under 8) stay lost.
+	int32_t hfs_object::free_inline(uint64_t offset, uint16_t capacity)
+	{
+		if (is_inline_tail(offset, capacity))
+		{
+			header.inline_used -= INLINE_RECORD_HEADER_SIZE + capacity;
+			write_header();
 			return 0;
 		}
-		// Buffer max size is cluster_size - position - 10 // Depth: How many next_cluster chains will it seek before writing // Ex_buff: adds an extra buffer and seeks to it before writing (unless size is 0)
-		int32_t write_buff(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth, int ex_buff)
+		if (capacity < sizeof(uint64_t))
+			return 0;
+		uint8_t f_record[INLINE_RECORD_HEADER_SIZE + sizeof(uint64_t)];
+		hfs_inline_record* f_rec = (hfs_inline_record*)f_record;
+		f_rec->capacity = capacity;
+		f_rec->used_bytes = INLINE_RECORD_FREE;
+		memcpy(f_record + INLINE_RECORD_HEADER_SIZE, &header.inline_free, sizeof(header.inline_free));
+		int32_t pc_val = patch_cluster(offset / header.cluster_size, offset % header.cluster_size, f_record, sizeof(f_record), false);
+		if (pc_val < 0)
+			return pc_val;
+		header.inline_free = offset;
+		write_header();
+		return 0;
+	}
+
+	// Reads the record header and as much of the payload as fits in the cluster in one go.
+	int32_t hfs_object::fetch_inline(uint64_t offset, uint8_t* record)
+	{
+		uint64_t r_offset = offset % header.cluster_size;
+		uint64_t r_size = header.cluster_size - r_offset < INLINE_RECORD_MAX ? header.cluster_size - r_offset : INLINE_RECORD_MAX;
+		return fetch_cluster(offset / header.cluster_size, r_offset, record, r_size, false);
+	}
+
+	// Returns 1 if the write doesn't fit in an inline record and the file has to be promoted to a data cluster.
+	int32_t hfs_object::write_inline(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth, int ex_buff)
+	{
+		hfs_reserved_file_entry h_rfe = rfe[fptr];
+		uint64_t end = position + size;
+		if (depth || ex_buff || end > INLINE_RECORD_MAX - INLINE_RECORD_HEADER_SIZE)
+			return 1;
+		uint8_t record[INLINE_RECORD_MAX];
+		hfs_inline_record* rec = (hfs_inline_record*)record;
+		memset(record, 0, INLINE_RECORD_MAX);
+		uint64_t o_offset = h_rfe.next_cluster;
+		uint16_t o_capacity = 0;
+		if (o_offset != CLUSTER_END)
 		{
-			fptr--;
-			hfs_reserved_file_entry h_rfe = rfe[fptr];
-			if ((depth - 1) > h_rfe.cluster_size && depth != 0)
-				return ERR_FILE_DEPTH_TOO_LARGE;
-			uint8_t lname_len = 0;
-			if (h_rfe.attribute & 0b10000000 && (depth || ex_buff))
+			int32_t fi_val = fetch_inline(o_offset, record);
+			if (fi_val < 0)
+				return fi_val;
+			o_capacity = rec->capacity;
+			// Bytes past the record belong to other files
+			memset(record + INLINE_RECORD_HEADER_SIZE + rec->capacity, 0, INLINE_RECORD_MAX - INLINE_RECORD_HEADER_SIZE - rec->capacity);
+		}
+		memcpy(record + INLINE_RECORD_HEADER_SIZE + position, buffer, size);
+		rec->used_bytes = end;
+		if (end > rec->capacity || o_offset == CLUSTER_END)
+		{
+			uint16_t capacity = (end + INLINE_RECORD_ALIGN - 1) & ~(uint64_t)(INLINE_RECORD_ALIGN - 1);
+			if (capacity < INLINE_RECORD_ALIGN)
+				capacity = INLINE_RECORD_ALIGN;
+			if (capacity > INLINE_RECORD_MAX - INLINE_RECORD_HEADER_SIZE)
+				capacity = INLINE_RECORD_MAX - INLINE_RECORD_HEADER_SIZE;
+			if (o_offset != CLUSTER_END && is_inline_tail(o_offset, o_capacity) && o_offset % header.cluster_size + INLINE_RECORD_HEADER_SIZE + capacity <= header.cluster_size - trailer_size())
 			{
-				fseek(h_rfe.next_cluster * header.cluster_size, SEEK_SET);
-				read(&lname_len, 1);
-				lname_len++;
-				position += lname_len;
+				// The last record of inline_cluster grows in place
+				header.inline_used += capacity - o_capacity;
+				write_header();
 			}
-			if (position + size + 8 + lname_len > header.cluster_size)
-				return ERR_FILE_BUFFER_TOO_LARGE;
-			if (ex_buff)
-				if (header.clusters_available == 0 || header.cluster_to_be_allocated == 0)
+			else
+			{
+				// Outgrown, the record is rewritten in one piece somewhere with enough room and the old one is freed afterwards.
+				h_rfe.next_cluster = alloc_inline(capacity);
+				if (h_rfe.next_cluster == CLUSTER_END)
 					return ERR_DATA_NO_SPACE;
+			}
+			rec->capacity = capacity;
+		}
+		int32_t pc_val = patch_cluster(h_rfe.next_cluster / header.cluster_size, h_rfe.next_cluster % header.cluster_size, record, INLINE_RECORD_HEADER_SIZE + rec->capacity, false);
+		if (pc_val < 0)
+			return pc_val;
+		h_rfe.modification_date = create_date_16();
+		rfe[fptr] = h_rfe;
+		int32_t wr_val = write_rfe(fptr);
+		if (wr_val < 0 || o_offset == CLUSTER_END || o_offset == h_rfe.next_cluster)
+			return wr_val;
+		return free_inline(o_offset, o_capacity);
+	}
+
+	// Moves an inline file into a data cluster of its own.
+	int32_t hfs_object::promote_inline(uint64_t fptr)
+	{
+		if (header.clusters_available == 0 || header.cluster_to_be_allocated == 0)
+			return ERR_DATA_NO_SPACE;
+		hfs_reserved_file_entry h_rfe = rfe[fptr];
+		uint8_t record[INLINE_RECORD_MAX];
+		hfs_inline_record* rec = (hfs_inline_record*)record;
+		rec->capacity = rec->used_bytes = 0;
+		uint64_t o_offset = h_rfe.next_cluster;
+		if (o_offset != CLUSTER_END)
+		{
+			int32_t fi_val = fetch_inline(o_offset, record);
+			if (fi_val < 0)
+				return fi_val;
+		}
+		h_rfe.cluster_size = 1;
+		h_rfe.next_cluster = header.cluster_to_be_allocated;
+		header.cluster_to_be_allocated++;
+		header.clusters_available--;
+		write_header();
+		write_new_cluster(h_rfe.next_cluster, record + INLINE_RECORD_HEADER_SIZE, rec->used_bytes, rec->used_bytes);
+		rfe[fptr] = h_rfe;
+		int32_t wr_val = write_rfe(fptr);
+		if (wr_val < 0 || o_offset == CLUSTER_END)
+			return wr_val;
+		return free_inline(o_offset, rec->capacity);
+	}
+
+	int32_t hfs_object::read_inline(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth)
+	{
+		hfs_reserved_file_entry h_rfe = rfe[fptr];
+		if (depth)
+			return ERR_FILE_DEPTH_TOO_LARGE;
+		if (position + size > INLINE_RECORD_MAX - INLINE_RECORD_HEADER_SIZE)
+			return ERR_FILE_BUFFER_TOO_LARGE;
+		if (h_rfe.next_cluster == CLUSTER_END)
+			return size ? ERR_FILE_BUFFER_TOO_LARGE : 0;
+		uint8_t record[INLINE_RECORD_MAX];
+		hfs_inline_record* rec = (hfs_inline_record*)record;
+		int32_t fi_val = fetch_inline(h_rfe.next_cluster, record);
+		if (fi_val < 0)
+			return fi_val;
+		if (position + size > rec->used_bytes)
+			return ERR_FILE_BUFFER_TOO_LARGE;
+		memcpy(buffer, record + INLINE_RECORD_HEADER_SIZE + position, size);
+		return 0;
+	}
+
+	// Follows depth next_cluster links. With HEADER_FEATURE_CHECKSUM the block holding the used_bytes and next_cluster of every cluster on the way
+	// is verified, the last cluster's is left in c_buff.
+	int32_t hfs_object::walk_chain(uint64_t& cluster, uint64_t depth)
+	{
+		int checksum = has_feature(HEADER_FEATURE_CHECKSUM);
+		uint64_t tail = used_bytes_offset();
+		int32_t rc_val = checksum ? load_blocks(cluster, tail, header.cluster_size - tail, false, false) : 0;
+		for (uint64_t i = 0; i < depth && rc_val == 0; i++)
+		{
+			uint64_t n_cluster = 0;
+			if (checksum)
+				memcpy(&n_cluster, c_buff + header.cluster_size - CLUSTER_CHAIN_SIZE, sizeof(n_cluster));
+			else
+			{
+				fseek(((cluster + 1) * header.cluster_size) - CLUSTER_CHAIN_SIZE, HFS_SEEK_SET);
+				read(&n_cluster, sizeof(n_cluster));
+			}
+			if (n_cluster == CLUSTER_END || n_cluster == CLUSTER_END_NUB)
+				return ERR_FILE_DEPTH_TOO_LARGE;
+			cluster = n_cluster;
+			if (checksum)
+				rc_val = load_blocks(cluster, tail, header.cluster_size - tail, false, false);
+		}
+		return rc_val;
+	}
+
+	// Buffer max size is cluster_size - position - 10 (16 with HEADER_FEATURE_WIDE_CLUSTER, +4 per CHECKSUM_BLOCK_SIZE with HEADER_FEATURE_CHECKSUM) // Depth: How many next_cluster chains will it seek before writing // Ex_buff: adds an extra buffer and seeks to it before writing (unless size is 0)
+	int32_t hfs_object::write_buff(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth, int ex_buff)
+	{
+		enter(HFS_API_WRITE_BUFF, size);
+		fptr--;
+		if (rfe[fptr].cluster_size == 0)
+		{
 			if (!is_locked(fptr))
 				return ERR_FILE_NOT_LOCKED;
-			fseek(h_rfe.next_cluster * header.cluster_size, HFS_SEEK_SET);
-			for (uint64_t i = 0; i < depth; i++)
+			int32_t wi_val = write_inline(fptr, buffer, size, position, depth, ex_buff);
+			if (wi_val != 1)
+				return wi_val;
+			int32_t pi_val = promote_inline(fptr);
+			if (pi_val < 0)
+				return pi_val;
+		}
+		hfs_reserved_file_entry h_rfe = rfe[fptr];
+		if ((depth - 1) > h_rfe.cluster_size && depth != 0)
+			return ERR_FILE_DEPTH_TOO_LARGE;
+		uint8_t lname_len = 0;
+		if (h_rfe.attribute & 0b10000000 && (depth || ex_buff))
+		{
+			fseek(h_rfe.next_cluster * header.cluster_size, SEEK_SET);
+			read(&lname_len, 1);
+			lname_len++;
+			position += lname_len;
+		}
+		if (position + size + trailer_size() + lname_len > header.cluster_size)
+			return ERR_FILE_BUFFER_TOO_LARGE;
+		if (ex_buff)
+			if (header.clusters_available == 0 || header.cluster_to_be_allocated == 0)
+				return ERR_DATA_NO_SPACE;
+		if (!is_locked(fptr))
+			return ERR_FILE_NOT_LOCKED;
+		uint64_t cluster = h_rfe.next_cluster;
+		int32_t wc_val = walk_chain(cluster, depth);
+		if (wc_val < 0)
+			return wc_val;
+		int checksum = has_feature(HEADER_FEATURE_CHECKSUM);
+		if (ex_buff)
+		{
+			uint64_t n_cluster = header.cluster_to_be_allocated;
+			if (checksum)
 			{
-				uint64_t n_cluster = 0;
-				fseek(header.cluster_size - 8, HFS_SEEK_CUR);
-				read(&n_cluster, sizeof(n_cluster));
-				if (n_cluster == CLUSTER_END || n_cluster == CLUSTER_END_NUB)
-					return ERR_FILE_DEPTH_TOO_LARGE;
-				fseek(n_cluster * header.cluster_size, HFS_SEEK_SET);
+				// The block is in c_buff from walk_chain
+				memcpy(c_buff + header.cluster_size - CLUSTER_CHAIN_SIZE, &n_cluster, sizeof(n_cluster));
+				store_blocks(cluster, header.cluster_size - CLUSTER_CHAIN_SIZE, CLUSTER_CHAIN_SIZE, false);
 			}
-			if (ex_buff)
+			else
+				patch_cluster(cluster, header.cluster_size - CLUSTER_CHAIN_SIZE, &n_cluster, sizeof(n_cluster), false);
+			cluster = n_cluster;
+			header.cluster_to_be_allocated++;
+			header.clusters_available--;
+			write_header();
+			h_rfe.cluster_size++;
+			// The new cluster may hold leftovers (defrag uses unallocated clusters as scratch)
+			write_new_cluster(cluster, nullptr, 0, 0);
+		}
+		uint64_t bytes_used = size + position;
+		// Narrow trailers can't describe a full cluster, it's marked with CLUSTER_END_NUB instead.
+		int is_full = !has_feature(HEADER_FEATURE_WIDE_CLUSTER) && (bytes_used >= header.cluster_size - trailer_size() || bytes_used > UINT16_MAX);
+		if (checksum)
+		{
+			// c_buff holds the trailer block from walk_chain or the cluster from write_new_cluster, of the other blocks only the ones the data
+			// partly covers are read.
+			uint64_t tail = (checksum_blocks() - 1) * CHECKSUM_BLOCK_SIZE;
+			if (size && position < tail)
 			{
-				fseek(header.cluster_size - 8, HFS_SEEK_CUR);
-				write(&header.cluster_to_be_allocated, sizeof(header.cluster_to_be_allocated));
-				fseek(header.cluster_to_be_allocated * header.cluster_size, HFS_SEEK_SET);
-				uint64_t p = ftell();
-				header.cluster_to_be_allocated++;
-				header.clusters_available--;
-				fseek(0, HFS_SEEK_SET);
-				write(&header, HEADER_SIZE);
-				fseek(p, HFS_SEEK_SET);
-				h_rfe.cluster_size++;
+				int32_t lb_val = load_blocks(cluster, position, std::min(size, tail - position), false, true);
+				if (lb_val < 0)
+					return lb_val;
 			}
-			uint64_t p = ftell();
-			fseek(position, HFS_SEEK_CUR);
+			memcpy(c_buff + position, buffer, size);
+			if (!is_full)
+				set_used_bytes(c_buff, bytes_used);
+			else
+			{
+				uint64_t n_cl = 0;
+				memcpy(&n_cl, c_buff + header.cluster_size - CLUSTER_CHAIN_SIZE, sizeof(n_cl));
+				if (n_cl == CLUSTER_END)
+				{
+					n_cl = CLUSTER_END_NUB;
+					memcpy(c_buff + header.cluster_size - CLUSTER_CHAIN_SIZE, &n_cl, sizeof(n_cl));
+				}
+			}
+			if (size)
+				store_blocks(cluster, position, size, false);
+			if (size == 0 || position + size <= tail)
+				store_blocks(cluster, tail, CHECKSUM_BLOCK_SIZE, false);
+		}
+		else
+		{
+			fseek(cluster * header.cluster_size + position, HFS_SEEK_SET);
 			write(buffer, size);
-			fseek(p, HFS_SEEK_SET);
-			fseek(header.cluster_size - 10 - lname_len, HFS_SEEK_CUR);
-			uint16_t bytes_used = size + position;
-			if (bytes_used < 0xFF6)
-				write(&bytes_used, sizeof(bytes_used));
+			fseek(cluster * header.cluster_size + used_bytes_offset(), HFS_SEEK_SET);
+			if (!is_full)
+				write_used_bytes(bytes_used);
 			else
 			{
-				fseek(2, HFS_SEEK_CUR);
+				fseek(sizeof(uint16_t), HFS_SEEK_CUR);
 				uint64_t is_last = 0;
 				uint64_t n_cl = CLUSTER_END_NUB;
-				p = ftell();
+				uint64_t p = ftell();
 				read(&is_last, sizeof(is_last));
 				fseek(p, HFS_SEEK_SET);
 				if (is_last == CLUSTER_END)
 					write(&n_cl, sizeof(n_cl));
 			}
-			h_rfe.modification_date = create_date_16();
-			rfe[fptr] = h_rfe;
-			write_rfe_chain();
+		}
+		h_rfe.modification_date = create_date_16();
+		rfe[fptr] = h_rfe;
+		return write_rfe(fptr);
+	}
+
+	int32_t hfs_object::read_buff(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth)
+	{
+		enter(HFS_API_READ_BUFF, size);
+		fptr--;
+		if (rfe[fptr].cluster_size == 0)
+			return read_inline(fptr, buffer, size, position, depth);
+		hfs_reserved_file_entry h_rfe = rfe[fptr];
+		if ((depth - 1) > h_rfe.cluster_size && depth > 0)
+			return ERR_FILE_DEPTH_TOO_LARGE;
+		uint8_t lname_len = 0;
+		if (h_rfe.attribute & 0b10000000 && depth)
+		{
+			fseek(h_rfe.next_cluster * header.cluster_size, SEEK_SET);
+			read(&lname_len, 1);
+			lname_len++;
+			position += lname_len;
+		}
+		if (position + size + trailer_size() + lname_len > header.cluster_size)
+			return ERR_FILE_BUFFER_TOO_LARGE;
+		uint64_t cluster = h_rfe.next_cluster;
+		int32_t wc_val = walk_chain(cluster, depth);
+		if (wc_val < 0)
+			return wc_val;
+		uint64_t n_cl = 0;
+		uint64_t bytes_used = 0;
+		if (has_feature(HEADER_FEATURE_CHECKSUM))
+		{
+			// The trailer block is already verified and in c_buff, only the blocks before it are read
+			bytes_used = get_used_bytes(c_buff);
+			memcpy(&n_cl, c_buff + header.cluster_size - CLUSTER_CHAIN_SIZE, sizeof(n_cl));
+			if (size > bytes_used && n_cl == CLUSTER_END)
+				return ERR_FILE_BUFFER_TOO_LARGE;
+			uint64_t tail = (checksum_blocks() - 1) * CHECKSUM_BLOCK_SIZE;
+			uint64_t head = position < tail ? std::min(size, tail - position) : 0;
+			int32_t fc_val = fetch_cluster(cluster, position, buffer, head, false);
+			if (fc_val < 0)
+				return fc_val;
+			memcpy((uint8_t*)buffer + head, c_buff + position + head, size - head);
 			return 0;
 		}
-		int32_t read_buff(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth)
+		fseek(cluster * header.cluster_size + used_bytes_offset(), HFS_SEEK_SET);
+		bytes_used = read_used_bytes();
+		read(&n_cl, sizeof(n_cl));
+		if (size > bytes_used && n_cl == CLUSTER_END)
+			return ERR_FILE_BUFFER_TOO_LARGE;
+		fseek(cluster * header.cluster_size + position, HFS_SEEK_SET);
+		read(buffer, size);
+		return 0;
+	}
+
+	// Records the owner of every allocated cluster. RFE chain and inline clusters are pinned as they can't be moved.
+	int32_t hfs_object::map_clusters(hfs_cluster_map& map)
+	{
+		int32_t rrc_val = read_rfe_chain();
+		if (rrc_val < 0)
+			return rrc_val;
+		uint64_t allocated = header.cluster_to_be_allocated ? header.cluster_to_be_allocated : header.clusters;
+		map.allocated = allocated;
+		map.pred.assign(allocated + 1, CMAP_FREE);
+		map.next.assign(allocated + 1, CLUSTER_END);
+		map.pred[0] = CMAP_PINNED;
+		uint64_t rfe_cluster = 1;
+		do
+		{
+			map.pred[rfe_cluster] = CMAP_PINNED;
+			hfs_reserved_chain_entry rce;
+			fseek(rfe_cluster * header.cluster_size + rce_offset(), HFS_SEEK_SET);
+			read(&rce, sizeof(rce));
+			rfe_cluster = rce.next_rfe_chain;
+		}
+		while (rfe_cluster > CLUSTER_END_NUB && rfe_cluster < allocated && map.pred[rfe_cluster] == CMAP_FREE);
+		if (header.inline_cluster != CLUSTER_END && header.inline_cluster < allocated)
+			map.pred[header.inline_cluster] = CMAP_PINNED;
+		// A cluster whose records were all freed has no file pointing into it, the inline_free list still does
+		uint64_t f_offset = has_feature(HEADER_FEATURE_INLINE) ? header.inline_free : CLUSTER_END;
+		uint64_t f_max = allocated * (header.cluster_size / (INLINE_RECORD_HEADER_SIZE + INLINE_RECORD_ALIGN));
+		for (uint64_t i = 0; i < f_max && f_offset != CLUSTER_END && f_offset / header.cluster_size < allocated; i++)
 		{
-			fptr--;
-			hfs_reserved_file_entry h_rfe = rfe[fptr];
-			if ((depth - 1) > h_rfe.cluster_size && depth > 0)
-				return ERR_FILE_DEPTH_TOO_LARGE;
-			uint8_t lname_len = 0;
-			if (h_rfe.attribute & 0b10000000 && depth)
+			map.pred[f_offset / header.cluster_size] = CMAP_PINNED;
+			uint8_t f_record[INLINE_RECORD_HEADER_SIZE + sizeof(uint64_t)];
+			int32_t fc_val = fetch_cluster(f_offset / header.cluster_size, f_offset % header.cluster_size, f_record, sizeof(f_record), false);
+			if (fc_val < 0)
+				return fc_val;
+			if (((hfs_inline_record*)f_record)->used_bytes != INLINE_RECORD_FREE)
+				break;
+			memcpy(&f_offset, f_record + INLINE_RECORD_HEADER_SIZE, sizeof(f_offset));
+		}
+		for (uint64_t i = 0; i < rfe.size(); i++)
+		{
+			uint64_t cluster = rfe[i].next_cluster;
+			if (rfe[i].cluster_size == 0)
 			{
-				fseek(h_rfe.next_cluster * header.cluster_size, SEEK_SET);
-				read(&lname_len, 1);
-				lname_len++;
-				position += lname_len;
+				if (cluster != CLUSTER_END && cluster / header.cluster_size < allocated)
+					map.pred[cluster / header.cluster_size] = CMAP_PINNED;
+				continue;
 			}
-			if (position + size + 8 + lname_len > header.cluster_size)
-				return ERR_FILE_BUFFER_TOO_LARGE;
-			fseek(h_rfe.next_cluster * header.cluster_size, HFS_SEEK_SET);
-			for (uint64_t i = 0; i < depth; i++)
+			if (cluster >= allocated || map.pred[cluster] != CMAP_FREE)
+				continue;
+			map.pred[cluster] = CMAP_RFE | i;
+			while (true)
 			{
 				uint64_t n_cluster = 0;
-				fseek(header.cluster_size - 8, HFS_SEEK_CUR);
+				fseek(((cluster + 1) * header.cluster_size) - CLUSTER_CHAIN_SIZE, HFS_SEEK_SET);
 				read(&n_cluster, sizeof(n_cluster));
-				if (n_cluster == CLUSTER_END || n_cluster == CLUSTER_END_NUB)
-					return ERR_FILE_DEPTH_TOO_LARGE;
-				fseek(n_cluster * header.cluster_size, HFS_SEEK_SET);
-			}
-			uint64_t p = ftell();
-			uint16_t bytes_used = 0;
-			uint64_t n_cl = 0;
-			fseek(header.cluster_size - 10, HFS_SEEK_CUR);
-			read(&bytes_used, sizeof(bytes_used));
-			read(&n_cl, sizeof(n_cl));
-			if (size > bytes_used && n_cl == CLUSTER_END)
-				return ERR_FILE_BUFFER_TOO_LARGE;
-			fseek(p, HFS_SEEK_SET);
-			fseek(position, HFS_SEEK_CUR);
-			read(buffer, size);
-			return 0;
-		}
-		// auth_level 0 = user 1 = root/owner
-		int f_can_read(uint64_t fptr, int auth_level)
-		{
-			fptr--;
-			auth_level *= 3;
-			return (rfe[fptr].attribute & (0b01000000 >> auth_level)) > 0;
+				map.next[cluster] = n_cluster;
+				if (n_cluster <= CLUSTER_END_NUB || n_cluster >= allocated || map.pred[n_cluster] != CMAP_FREE)
+					break;
+				map.pred[n_cluster] = cluster;
+				cluster = n_cluster;
+			}
 		}
-		int f_can_write(uint64_t fptr, int auth_level)
+		return 0;
+	}
+
+	void hfs_object::chain_of(hfs_cluster_map& map, uint64_t fptr, std::vector<uint64_t>& chain)
+	{
+		chain.clear();
+		uint64_t cluster = rfe[fptr].next_cluster;
+		while (cluster > CLUSTER_END_NUB && cluster < map.allocated && chain.size() < map.allocated)
 		{
-			fptr--;
-			auth_level *= 3;
-			return (rfe[fptr].attribute & (0b00100000 >> auth_level)) > 0;
+			chain.push_back(cluster);
+			cluster = map.next[cluster];
 		}
-		int f_can_execute(uint64_t fptr, int auth_level)
+	}
+
+	void hfs_object::frag_stats_of(hfs_cluster_map& map, hfs_frag_stats* stats)
+	{
+		stats->files = stats->clusters = stats->fragments = 0;
+		std::vector<uint64_t> chain;
+		for (uint64_t i = 0; i < rfe.size(); i++)
 		{
-			fptr--;
-			auth_level *= 3;
-			return (rfe[fptr].attribute & (0b00010000 >> auth_level)) > 0;
+			if (rfe[i].cluster_size == 0)
+				continue;
+			chain_of(map, i, chain);
+			if (chain.size() == 0)
+				continue;
+			stats->files++;
+			stats->clusters += chain.size();
+			stats->fragments++;
+			for (size_t c = 1; c < chain.size(); c++)
+			{
+				if (chain[c] != chain[c - 1] + 1)
+					stats->fragments++;
+			}
 		}
-		int f_is_hidden(uint64_t fptr)
+	}
+
+	int32_t hfs_object::frag_stats(hfs_frag_stats* stats)
+	{
+		enter(HFS_API_FRAG_STATS, 0);
+		hfs_cluster_map map;
+		int32_t mc_val = map_clusters(map);
+		if (mc_val < 0)
+			return mc_val;
+		frag_stats_of(map, stats);
+		return 0;
+	}
+
+	// Points whatever references the cluster in pred to cluster, each redirect is a single 8 byte write.
+	int32_t hfs_object::redirect(uint64_t pred, uint64_t cluster)
+	{
+		if (pred & CMAP_RFE)
 		{
-			fptr--;
-			return (rfe[fptr].attribute & 0b00000001) > 0;
+			uint64_t index = pred & ~CMAP_RFE;
+			uint64_t offset = rfe.offset(index) + offsetof(hfs_reserved_file_entry, next_cluster);
+			rfe[index].next_cluster = cluster;
+			return patch_cluster(offset / header.cluster_size, offset % header.cluster_size, &cluster, sizeof(cluster), true);
 		}
-		uint16_t f_creation_date(uint64_t fptr)
+		return patch_cluster(pred, header.cluster_size - CLUSTER_CHAIN_SIZE, &cluster, sizeof(cluster), false);
+	}
+
+	// Copies from into to and switches its reference over, from isn't referenced afterwards.
+	int32_t hfs_object::relocate(hfs_cluster_map& map, uint64_t from, uint64_t to)
+	{
+		// A damaged cluster isn't copied, its checksum would be made valid by the move.
+		int32_t rc_val = read_cluster(from, c_buff, false);
+		if (rc_val < 0)
+			return rc_val;
+		fseek(to * header.cluster_size, HFS_SEEK_SET);
+		write(c_buff, header.cluster_size);
+		map.pred[to] = map.pred[from];
+		map.next[to] = map.next[from];
+		if (map.next[to] > CLUSTER_END_NUB && map.next[to] < map.pred.size())
+			map.pred[map.next[to]] = to;
+		if (!(map.pred[to] & CMAP_RFE))
+			map.next[map.pred[to]] = to;
+		map.pred[from] = CMAP_FREE;
+		map.next[from] = CLUSTER_END;
+		return redirect(map.pred[to], to);
+	}
+
+	// Copies chain[c] to chain[c + count - 1] into the free clusters starting at to with one write (and one read per contiguous part of the
+	// source), then switches the file over with a single redirect.
+	int32_t hfs_object::relocate_run(hfs_cluster_map& map, std::vector<uint64_t>& chain, uint64_t c, uint64_t to, uint64_t count)
+	{
+		uint64_t cluster_size = header.cluster_size;
+		uint8_t* run = defrag_state.run.data();
+		for (uint64_t d = 0; d < count;)
 		{
-			fptr--;
-			return rfe[fptr].creation_date;
+			uint64_t r = 1;
+			while (d + r < count && chain[c + d + r] == chain[c + d] + r)
+				r++;
+			fseek(chain[c + d] * cluster_size, HFS_SEEK_SET);
+			read(run + d * cluster_size, r * cluster_size);
+			d += r;
 		}
-		uint16_t f_modification_date(uint64_t fptr)
+		for (uint64_t d = 0; d < count; d++)
 		{
-			fptr--;
-			return rfe[fptr].modification_date;
+			uint8_t* buff = run + d * cluster_size;
+			int32_t vc_val = verify_cluster(buff, false);
+			if (vc_val < 0)
+				return vc_val;
+			if (d + 1 < count)
+			{
+				uint64_t n_cluster = to + d + 1;
+				memcpy(buff + cluster_size - CLUSTER_CHAIN_SIZE, &n_cluster, sizeof(n_cluster));
+				seal_blocks(buff, false, checksum_blocks() - 1, checksum_blocks() - 1);
+			}
 		}
-		uint8_t f_get_owner(uint64_t fptr)
+		fseek(to * cluster_size, HFS_SEEK_SET);
+		write(run, count * cluster_size);
+		uint64_t pred = map.pred[chain[c]];
+		uint64_t n_last = map.next[chain[c + count - 1]];
+		for (uint64_t d = 0; d < count; d++)
 		{
-			fptr--;
-			return rfe[fptr].owner_id;
+			map.pred[chain[c + d]] = CMAP_FREE;
+			map.next[chain[c + d]] = CLUSTER_END;
 		}
-		// 12 bytes 4 bytes
-		void f_get_name(uint64_t fptr, uint8_t* name, uint8_t* extention)
+		for (uint64_t d = 0; d < count; d++)
 		{
-			fptr--;
-			memcpy(name, rfe[fptr].name, 12);
-			memcpy(extention, rfe[fptr].extention, 4);
+			map.pred[to + d] = d ? to + d - 1 : pred;
+			map.next[to + d] = d + 1 < count ? to + d + 1 : n_last;
+			chain[c + d] = to + d;
 		}
-		void f_set_read(uint64_t fptr, int auth_level, int val)
+		if (n_last > CLUSTER_END_NUB && n_last < map.pred.size())
+			map.pred[n_last] = to + count - 1;
+		if (!(pred & CMAP_RFE))
+			map.next[pred] = to;
+		return redirect(pred, to);
+	}
+
+	// Moves the chains of fragmented files into contiguous runs, in RFE order from the start of the volume. Runs of free clusters are filled
+	// with one batched copy, clusters occupying a run are swapped out through the first unallocated cluster so that every step leaves the volume consistent.
+	// Everything read or written counts against io_budget, at least one step is made per call. The cluster map and the position are kept
+	// until the layout changes, so later calls pick up where the last one stopped.
+	// Returns 1 if the budget ran out before the volume was defragmented, call again to continue. Returns 2 when the pass finished but left files
+	// fragmented because pinned clusters (RFE chain, inline clusters) leave no run long enough for them before the end of the allocated clusters.
+	int32_t hfs_object::defrag(uint64_t io_budget, hfs_frag_stats* before, hfs_frag_stats* after)
+	{
+		enter(HFS_API_DEFRAG, 0);
+		uint64_t start = io_bytes;
+		hfs_defrag_state& state = defrag_state;
+		hfs_cluster_map& map = state.map;
+		if (!state.valid || state.layout_gen != layout_gen)
 		{
-			fptr--;
-			uint8_t magic = 0b01000000 >> (auth_level * 3);
-			rfe[fptr].attribute ^= magic;
-			rfe[fptr].attribute |= val ? magic : 0;
-			write_rfe_chain();
+			int32_t mc_val = map_clusters(map);
+			if (mc_val < 0)
+				return mc_val;
+			state.layout_gen = layout_gen;
+			state.file = 0;
+			state.cursor = 2;
+			state.skipped = 0;
+			state.valid = true;
 		}
-		void f_set_write(uint64_t fptr, int auth_level, int val)
+		if (before)
+			frag_stats_of(map, before);
+		uint64_t cluster_size = header.cluster_size;
+		uint64_t allocated = map.allocated;
+		uint64_t scratch = header.cluster_to_be_allocated;
+		uint64_t run_max = DEFRAG_RUN_BYTES / cluster_size ? DEFRAG_RUN_BYTES / cluster_size : 1;
+		if (state.run.size() < run_max * cluster_size)
+			state.run.resize(run_max * cluster_size);
+		// Rough cost of a redirect, with checksums it reads and rewrites the block holding the reference
+		uint64_t redirect_cost = has_feature(HEADER_FEATURE_CHECKSUM) ? 2 * CHECKSUM_BLOCK_SIZE : CLUSTER_CHAIN_SIZE;
+		uint64_t steps = 0;
+		int32_t ret_val = 0;
+		std::vector<uint64_t>& chain = state.chain;
+		for (; state.file < rfe.size(); state.file++)
 		{
-			fptr--;
-			uint8_t magic = 0b00100000 >> (auth_level * 3);
-			rfe[fptr].attribute ^= magic;
-			rfe[fptr].attribute |= val ? magic : 0;
-			write_rfe_chain();
+			if (rfe[state.file].cluster_size == 0)
+				continue;
+			chain_of(map, state.file, chain);
+			uint64_t n = chain.size();
+			if (n == 0)
+				continue;
+			uint64_t target = state.cursor;
+			for (uint64_t c = target; c < target + n && target + n <= allocated; c++)
+			{
+				if (map.pred[c] == CMAP_PINNED)
+					target = c + 1;
+			}
+			if (target + n > allocated)
+			{
+				for (uint64_t c = 1; c < n; c++)
+				{
+					if (chain[c] != chain[c - 1] + 1)
+					{
+						state.skipped++;
+						break;
+					}
+				}
+				continue;
+			}
+			for (uint64_t c = 0; c < n;)
+			{
+				uint64_t to = target + c;
+				if (chain[c] == to)
+				{
+					c++;
+					continue;
+				}
+				uint64_t spent = io_bytes - start;
+				if (map.pred[to] == CMAP_FREE)
+				{
+					uint64_t count = 1;
+					while (count < run_max && c + count < n && map.pred[to + count] == CMAP_FREE && chain[c + count] != to + count)
+						count++;
+					uint64_t fits = spent + redirect_cost < io_budget ? (io_budget - spent - redirect_cost) / (2 * cluster_size) : 0;
+					if (fits == 0 && steps)
+					{
+						ret_val = 1;
+						break;
+					}
+					if (count > fits)
+						count = fits ? fits : 1;
+					ret_val = relocate_run(map, chain, c, to, count);
+					c += count;
+				}
+				else
+				{
+					if (steps && spent + 3 * (2 * cluster_size + redirect_cost) > io_budget)
+					{
+						ret_val = 1;
+						break;
+					}
+					if (header.clusters_available == 0 || scratch == 0)
+					{
+						ret_val = ERR_DATA_NO_SPACE;
+						break;
+					}
+					uint64_t from = chain[c];
+					ret_val = relocate(map, to, scratch);
+					if (ret_val == 0)
+						ret_val = relocate(map, from, to);
+					if (ret_val == 0)
+						ret_val = relocate(map, scratch, from);
+					chain[c] = to;
+					for (uint64_t d = c + 1; d < n; d++)
+					{
+						if (chain[d] == to)
+							chain[d] = from;
+					}
+					c++;
+				}
+				if (ret_val < 0)
+					break;
+				steps++;
+			}
+			if (ret_val != 0)
+				break;
+			state.cursor = target + n;
 		}
-		void f_set_execute(uint64_t fptr, int auth_level, int val)
+		if (ret_val == 0 && state.file == rfe.size() && state.skipped)
+			ret_val = 2;
+		if (after)
+			frag_stats_of(map, after);
+		// A finished pass starts over on the next call, so does one that failed half way
+		if (ret_val != 1)
+			state.valid = false;
+		return ret_val;
+	}
+
+	// auth_level 0 = user 1 = root/owner
+	int hfs_object::f_can_read(uint64_t fptr, int auth_level)
+	{
+		fptr--;
+		auth_level *= 3;
+		return (rfe[fptr].attribute & (0b01000000 >> auth_level)) > 0;
+	}
+
+	int hfs_object::f_can_write(uint64_t fptr, int auth_level)
+	{
+		fptr--;
+		auth_level *= 3;
+		return (rfe[fptr].attribute & (0b00100000 >> auth_level)) > 0;
+	}
+
+	int hfs_object::f_can_execute(uint64_t fptr, int auth_level)
+	{
+		fptr--;
+		auth_level *= 3;
+		return (rfe[fptr].attribute & (0b00010000 >> auth_level)) > 0;
+	}
+
+	int hfs_object::f_is_hidden(uint64_t fptr)
+	{
+		fptr--;
+		return (rfe[fptr].attribute & 0b00000001) > 0;
+	}
+
+	uint16_t hfs_object::f_creation_date(uint64_t fptr)
+	{
+		fptr--;
+		return rfe[fptr].creation_date;
+	}
+
+	uint16_t hfs_object::f_modification_date(uint64_t fptr)
+	{
+		fptr--;
+		return rfe[fptr].modification_date;
+	}
+
+	uint8_t hfs_object::f_get_owner(uint64_t fptr)
+	{
+		fptr--;
+		return rfe[fptr].owner_id;
+	}
+
+	// 12 bytes 4 bytes
+	void hfs_object::f_get_name(uint64_t fptr, uint8_t* name, uint8_t* extention)
+	{
+		fptr--;
+		memcpy(name, rfe[fptr].name, 12);
+		memcpy(extention, rfe[fptr].extention, 4);
+	}
+
+	void hfs_object::f_set_read(uint64_t fptr, int auth_level, int val)
+	{
+		enter(HFS_API_F_SET, 0);
+		fptr--;
+		uint8_t magic = 0b01000000 >> (auth_level * 3);
+		rfe[fptr].attribute ^= magic;
+		rfe[fptr].attribute |= val ? magic : 0;
+		write_rfe(fptr);
+	}
+
+	void hfs_object::f_set_write(uint64_t fptr, int auth_level, int val)
+	{
+		enter(HFS_API_F_SET, 0);
+		fptr--;
+		uint8_t magic = 0b00100000 >> (auth_level * 3);
+		rfe[fptr].attribute ^= magic;
+		rfe[fptr].attribute |= val ? magic : 0;
+		write_rfe(fptr);
+	}
+
+	void hfs_object::f_set_execute(uint64_t fptr, int auth_level, int val)
+	{
+		enter(HFS_API_F_SET, 0);
+		fptr--;
+		uint8_t magic = 0b00010000 >> (auth_level * 3);
+		rfe[fptr].attribute ^= magic;
+		rfe[fptr].attribute |= val ? magic : 0;
+		write_rfe(fptr);
+	}
+
+	void hfs_object::f_set_hidden(uint64_t fptr, int val)
+	{
+		enter(HFS_API_F_SET, 0);
+		fptr--;
+		uint8_t magic = 0b00000001;
+		rfe[fptr].attribute ^= magic;
+		rfe[fptr].attribute |= val ? magic : 0;
+		write_rfe(fptr);
+	}
+
+	void hfs_object::f_set_owner(uint8_t owner)
+	{
+		enter(HFS_API_F_SET, 0);
+		header.owner_id = owner;
+		write_header();
+	}
+
+	void hfs_object::f_set_name(uint64_t fptr, uint8_t* name, uint8_t* extention)
+	{
+		enter(HFS_API_F_SET, 0);
+		fptr--;
+		memcpy(rfe[fptr].name, name, 12);
+		memcpy(rfe[fptr].extention, extention, 4);
+		write_rfe(fptr);
+	}
+
+	uint16_t hfs_object::vol_creation_date()
+	{
+		return header.creation_date;
+	}
+
+	uint64_t hfs_object::vol_size()
+	{
+		return header.cluster_size * header.clusters;
+	}
+
+	// 12 bytes
+	void hfs_object::vol_get_name(uint8_t* name)
+	{
+		memcpy(name, header.name, 12);
+	}
+
+	void hfs_object::vol_set_name(uint8_t* name)
+	{
+		enter(HFS_API_VOL_SET, 0);
+		memcpy(header.name, name, 12);
+		write_header();
+	}
+
+	uint8_t hfs_object::vol_get_version()
+	{
+		return header.attribute & 0b00000011;
+	}
+
+	int hfs_object::vol_can_read(int auth_level)
+	{
+		return (header.attribute & (0b01000000 >> (auth_level * 3))) > 0;
+	}
+
+	int hfs_object::vol_can_write(int auth_level)
+	{
+		return (header.attribute & (0b00100000 >> (auth_level * 3))) > 0;
+	}
+
+	int hfs_object::vol_is_hidden()
+	{
+		return (header.attribute & 0b00000100) > 0;
+	}
+
+	void hfs_object::vol_set_read(int auth_level, int val)
+	{
+		enter(HFS_API_VOL_SET, 0);
+		uint8_t magic = 0b01000000 >> (auth_level * 3);
+		header.attribute ^= magic;
+		header.attribute |= val ? magic : 0;
+		write_header();
+	}
+
+	void hfs_object::vol_set_write(int auth_level, int val)
+	{
+		enter(HFS_API_VOL_SET, 0);
+		uint8_t magic = 0b00100000 >> (auth_level * 3);
+		header.attribute ^= magic;
+		header.attribute |= val ? magic : 0;
+		write_header();
+	}
+
+	void hfs_object::vol_set_hidden(int val)
+	{
+		enter(HFS_API_VOL_SET, 0);
+		uint8_t magic = header.attribute & 0b00000100;
+		header.attribute ^= magic;
+		header.attribute |= val ? magic : 0;
+		write_header();
+	}
+
+	// One thread per member, started by hfs_stripe_open
+	struct hfs_stripe_workers
+	{
+		std::vector<std::thread> threads;
+		std::mutex lock;
+		std::condition_variable work;
+		std::condition_variable done;
+		std::vector<uint8_t> busy; // Set for the members with segments of the current request
+		size_t pending = 0;
+		int stop = false;
+		void* buffer = nullptr;
+		int is_write = false;
+	};
+
+	size_t stripe_rfe_slot(hfs_stripe* stripe, uint64_t cluster)
+	{
+		for (size_t slot = 0; slot < stripe->rfe_clusters.size(); slot++)
 		{
-			fptr--;
-			uint8_t magic = 0b00010000 >> (auth_level * 3);
-			rfe[fptr].attribute ^= magic;
-			rfe[fptr].attribute |= val ? magic : 0;
-			write_rfe_chain();
+			if (stripe->rfe_clusters[slot] == cluster)
+				return slot;
 		}
-		void f_set_hidden(uint64_t fptr, int val)
+		return SIZE_MAX;
+	}
+
+	void stripe_map(hfs_stripe* stripe, size_t size, size_t position)
+	{
+		std::vector<hfs_stripe_segment>& segments = stripe->segments;
+		segments.clear();
+		uint64_t cluster_size = stripe->cluster_size;
+		uint64_t label_size = stripe->label_size;
+		uint64_t mirror_end = stripe->mirror_clusters * cluster_size;
+		uint64_t data_start = label_size + (stripe->mirror_clusters + stripe->rfe_mirror_clusters) * cluster_size;
+		uint64_t stripe_size = stripe->stripe_clusters * cluster_size;
+		uint64_t members = stripe->members.size();
+		size_t done = 0;
+		while (done < size)
 		{
-			fptr--;
-			uint8_t magic = 0b00000001;
-			rfe[fptr].attribute ^= magic;
-			rfe[fptr].attribute |= val ? magic : 0;
-			write_rfe_chain();
+			size_t l_pos = position + done;
+			hfs_stripe_segment seg;
+			seg.buff_offset = done;
+			size_t slot = l_pos < mirror_end ? SIZE_MAX : stripe_rfe_slot(stripe, l_pos / cluster_size);
+			if (l_pos < mirror_end)
+			{
+				seg.member = SIZE_MAX;
+				seg.position = label_size + l_pos;
+				seg.size = std::min<size_t>(size - done, mirror_end - l_pos);
+			}
+			else if (slot != SIZE_MAX)
+			{
+				seg.member = SIZE_MAX;
+				seg.position = label_size + mirror_end + slot * cluster_size + l_pos % cluster_size;
+				seg.size = std::min<size_t>(size - done, cluster_size - l_pos % cluster_size);
+			}
+			else
+			{
+				// Cut at cluster boundaries so a mirrored RFE cluster inside the range is noticed, neighbours on the same member are merged again below.
+				uint64_t s_pos = l_pos - mirror_end;
+				uint64_t stripe_index = s_pos / stripe_size;
+				seg.member = stripe_index % members;
+				seg.position = data_start + (stripe_index / members) * stripe_size + s_pos % stripe_size;
+				seg.size = std::min<size_t>(size - done, cluster_size - l_pos % cluster_size);
+			}
+			if (segments.size() > 0 && segments.back().member == seg.member && segments.back().position + segments.back().size == seg.position)
+				segments.back().size += seg.size;
+			else
+				segments.push_back(seg);
+			done += seg.size;
 		}
-		void f_set_owner(uint8_t owner)
+	}
+
+	void stripe_run_member(hfs_stripe* stripe, size_t member, void* buffer, int is_write)
+	{
+		hfs_stripe_member& m = stripe->members[member];
+		for (hfs_stripe_segment& seg : stripe->segments)
 		{
-			header.owner_id = owner;
-			fseek(0, HFS_SEEK_SET);
-			write(&header, HEADER_SIZE);
+			if (seg.member != member && !(seg.member == SIZE_MAX && (is_write || member == 0)))
+				continue;
+			if (is_write)
+				m.write_fn((uint8_t*)buffer + seg.buff_offset, seg.size, seg.position, m.extra_args);
+			else
+				m.read_fn((uint8_t*)buffer + seg.buff_offset, seg.size, seg.position, m.extra_args);
 		}
-		void f_set_name(uint64_t fptr, uint8_t* name, uint8_t* extention)
+	}
+
+	// Writes the label of every member, with the slots taken so far
+	void stripe_write_labels(hfs_stripe* stripe)
+	{
+		uint8_t* buff = stripe->buff.data();
+		memset(buff, 0, stripe->label_size);
+		hfs_stripe_label* label = (hfs_stripe_label*)buff;
+		label->signature = STRIPE_SIGNATURE;
+		label->members = stripe->members.size();
+		label->cluster_size = stripe->cluster_size;
+		label->stripe_clusters = stripe->stripe_clusters;
+		label->mirror_clusters = stripe->mirror_clusters;
+		label->rfe_mirror_clusters = stripe->rfe_mirror_clusters;
+		label->slots_used = stripe->rfe_clusters.size();
+		if (stripe->rfe_clusters.size())
+			memcpy(buff + sizeof(hfs_stripe_label), stripe->rfe_clusters.data(), stripe->rfe_clusters.size() * sizeof(uint64_t));
+		for (size_t member = 0; member < stripe->members.size(); member++)
 		{
-			fptr--;
-			memcpy(rfe[fptr].name, name, 12);
-			memcpy(rfe[fptr].extention, extention, 4);
-			write_rfe_chain();
+			hfs_stripe_member& m = stripe->members[member];
+			label->member = member;
+			m.write_fn(buff, stripe->label_size, 0, m.extra_args);
 		}
-		uint16_t vol_creation_date()
+	}
+
+	// Gives an RFE chain cluster the next slot, what was written to the cluster before it got linked is carried over into the slot.
+	int32_t stripe_add_slot(hfs_stripe* stripe, uint64_t cluster)
+	{
+		if (stripe->rfe_clusters.size() == stripe->rfe_mirror_clusters)
+			return stripe->error = ERR_STRIPE_INVALID;
+		uint64_t cluster_size = stripe->cluster_size;
+		uint8_t* buff = stripe->buff.data();
+		stripe_map(stripe, cluster_size, cluster * cluster_size);
+		for (size_t member = 0; member < stripe->members.size(); member++)
+			stripe_run_member(stripe, member, buff, false);
+		uint64_t slot = stripe->rfe_clusters.size();
+		stripe->rfe_clusters.push_back(cluster);
+		stripe_map(stripe, cluster_size, cluster * cluster_size);
+		for (size_t member = 0; member < stripe->members.size(); member++)
+			stripe_run_member(stripe, member, buff, true);
+		// The slot map entry goes first, slots_used makes it valid
+		uint64_t slots_used = slot + 1;
+		for (hfs_stripe_member& m : stripe->members)
 		{
-			return header.creation_date;
+			m.write_fn(&cluster, sizeof(cluster), sizeof(hfs_stripe_label) + slot * sizeof(uint64_t), m.extra_args);
+			m.write_fn(&slots_used, sizeof(slots_used), offsetof(hfs_stripe_label, slots_used), m.extra_args);
 		}
-		uint64_t vol_size()
+		return 0;
+	}
+
+	// Follows next_rfe_chain from the last known RFE chain cluster while a write covers it, a cluster about to be linked gets the next slot.
+	int32_t stripe_learn_rfe(hfs_stripe* stripe, void* buffer, size_t size, size_t position)
+	{
+		uint64_t cluster_size = stripe->cluster_size;
+		uint64_t rce_offset = (cluster_size - 24) / 40 * 40;
+		uint64_t cluster = stripe->rfe_clusters.size() ? stripe->rfe_clusters.back() : 1;
+		while (true)
 		{
-			return header.cluster_size * header.clusters;
+			uint64_t pos = cluster * cluster_size + rce_offset;
+			if (pos < position || pos + sizeof(uint64_t) > position + size)
+				return 0;
+			uint64_t n_cluster = 0;
+			memcpy(&n_cluster, (uint8_t*)buffer + pos - position, sizeof(n_cluster));
+			if (n_cluster <= CLUSTER_END_NUB || n_cluster < stripe->mirror_clusters || stripe_rfe_slot(stripe, n_cluster) != SIZE_MAX)
+				return 0;
+			int32_t as_val = stripe_add_slot(stripe, n_cluster);
+			if (as_val < 0)
+				return as_val;
+			cluster = n_cluster;
 		}
-		// 12 bytes
-		void vol_get_name(uint8_t* name)
+	}
+
+	void stripe_worker(hfs_stripe* stripe, size_t member)
+	{
+		hfs_stripe_workers* workers = stripe->workers;
+		std::unique_lock<std::mutex> guard(workers->lock);
+		while (true)
 		{
-			memcpy(name, header.name, 12);
+			workers->work.wait(guard, [&]() { return workers->stop || workers->busy[member]; });
+			if (workers->stop)
+				return;
+			guard.unlock();
+			stripe_run_member(stripe, member, workers->buffer, workers->is_write);
+			guard.lock();
+			workers->busy[member] = 0;
+			if (--workers->pending == 0)
+				workers->done.notify_one();
 		}
-		void vol_set_name(uint8_t* name)
+	}
+
+	size_t stripe_io(hfs_stripe* stripe, void* buffer, size_t size, size_t position, int is_write)
+	{
+		uint64_t members = stripe->members.size();
+		if (stripe->label_size == 0 || (is_write && stripe->error))
+			return stripe->position = position;
+		// A cluster has to have its slot before the write linking it into the RFE chain goes out
+		if (is_write && stripe_learn_rfe(stripe, buffer, size, position) < 0)
+			return stripe->position = position;
+		stripe_map(stripe, size, position);
+		hfs_stripe_workers* workers = stripe->workers;
+		if (!workers)
 		{
-			memcpy(header.name, name, 12);
-			fseek(0, HFS_SEEK_SET);
-			write(&header, HEADER_SIZE);
+			for (size_t member = 0; member < members; member++)
+				stripe_run_member(stripe, member, buffer, is_write);
 		}
-		uint8_t vol_get_version()
+		else
 		{
-			return header.attribute & 0b00000011;
+			// The calling thread takes the first member with work, the workers of the others are woken up.
+			size_t first = SIZE_MAX;
+			{
+				std::lock_guard<std::mutex> guard(workers->lock);
+				workers->buffer = buffer;
+				workers->is_write = is_write;
+				for (hfs_stripe_segment& seg : stripe->segments)
+				{
+					size_t m_first = seg.member == SIZE_MAX ? 0 : seg.member;
+					size_t m_last = seg.member == SIZE_MAX ? (is_write ? members - 1 : 0) : seg.member;
+					for (size_t member = m_first; member <= m_last; member++)
+					{
+						if (first == SIZE_MAX)
+							first = member;
+						else if (member != first && !workers->busy[member])
+						{
+							workers->busy[member] = 1;
+							workers->pending++;
+						}
+					}
+				}
+			}
+			workers->work.notify_all();
+			stripe_run_member(stripe, first, buffer, is_write);
+			std::unique_lock<std::mutex> guard(workers->lock);
+			workers->done.wait(guard, [&]() { return workers->pending == 0; });
 		}
-		int vol_can_read(int auth_level)
+		return stripe->position = position + size;
+	}
+
+	// Reads the labels of the members (labelling them if the first one has none) and starts a thread per member.
+	// The geometry of an existing label replaces the one in the stripe, labels that don't agree are ERR_STRIPE_INVALID.
+	int32_t hfs_stripe_open(hfs_stripe* stripe)
+	{
+		size_t members = stripe->members.size();
+		if (members == 0 || stripe->cluster_size == 0 || stripe->stripe_clusters == 0 || stripe->mirror_clusters < 2)
+			return ERR_STRIPE_INVALID;
+		hfs_stripe_label first;
+		memset(&first, 0, sizeof(first));
+		stripe->members[0].read_fn(&first, sizeof(first), 0, stripe->members[0].extra_args);
+		int is_new = first.signature != STRIPE_SIGNATURE;
+		if (!is_new)
 		{
-			return (header.attribute & (0b01000000 >> (auth_level * 3))) > 0;
+			if (first.members != members || first.cluster_size != stripe->cluster_size || first.stripe_clusters == 0 || first.mirror_clusters < 2 || first.slots_used > first.rfe_mirror_clusters)
+				return ERR_STRIPE_INVALID;
+			stripe->stripe_clusters = first.stripe_clusters;
+			stripe->mirror_clusters = first.mirror_clusters;
+			stripe->rfe_mirror_clusters = first.rfe_mirror_clusters;
 		}
-		int vol_can_write(int auth_level)
+		uint64_t label_bytes = sizeof(hfs_stripe_label) + stripe->rfe_mirror_clusters * sizeof(uint64_t);
+		uint64_t label_size = (label_bytes + stripe->cluster_size - 1) / stripe->cluster_size * stripe->cluster_size;
+		stripe->buff.assign(std::max(label_size, stripe->cluster_size), 0);
+		stripe->segments.reserve(members * 2 + 16);
+		stripe->rfe_clusters.clear();
+		stripe->rfe_clusters.reserve(stripe->rfe_mirror_clusters);
+		stripe->label_size = label_size;
+		stripe->error = 0;
+		if (is_new)
+			stripe_write_labels(stripe);
+		else
 		{
-			return (header.attribute & (0b00100000 >> (auth_level * 3))) > 0;
+			uint8_t* buff = stripe->buff.data();
+			hfs_stripe_label* label = (hfs_stripe_label*)buff;
+			uint64_t* slots = (uint64_t*)(buff + sizeof(hfs_stripe_label));
+			for (size_t member = 0; member < members; member++)
+			{
+				hfs_stripe_member& m = stripe->members[member];
+				m.read_fn(buff, label_bytes, 0, m.extra_args);
+				first.member = member;
+				if (memcmp(label, &first, sizeof(first)))
+				{
+					stripe->label_size = 0;
+					return ERR_STRIPE_INVALID;
+				}
+				for (uint64_t slot = 0; slot < first.slots_used; slot++)
+				{
+					if (member == 0)
+						stripe->rfe_clusters.push_back(slots[slot]);
+					else if (stripe->rfe_clusters[slot] != slots[slot])
+					{
+						stripe->label_size = 0;
+						return ERR_STRIPE_INVALID;
+					}
+				}
+			}
 		}
-		int vol_is_hidden()
+		if (stripe->workers || members == 1)
+			return 0;
+		hfs_stripe_workers* workers = new hfs_stripe_workers;
+		workers->busy.assign(members, 0);
+		stripe->workers = workers;
+		for (size_t member = 0; member < members; member++)
+			workers->threads.emplace_back(stripe_worker, stripe, member);
+		return 0;
+	}
+
+	void hfs_stripe_close(hfs_stripe* stripe)
+	{
+		hfs_stripe_workers* workers = stripe->workers;
+		if (!workers)
+			return;
 		{
-			return (header.attribute & 0b00000100) > 0;
+			std::lock_guard<std::mutex> guard(workers->lock);
+			workers->stop = true;
 		}
-		void vol_set_read(int auth_level, int val)
+		workers->work.notify_all();
+		for (std::thread& t : workers->threads)
+			t.join();
+		delete workers;
+		stripe->workers = nullptr;
+	}
+
+	size_t hfs_stripe_read(void* buffer, size_t size, size_t position, void* stripe_vptr)
+	{
+		hfs_stripe* stripe = (hfs_stripe*)stripe_vptr;
+		if (size == 0)
+			return stripe->position;
+		return stripe_io(stripe, buffer, size, position, false);
+	}
+
+	size_t hfs_stripe_write(void* buffer, size_t size, size_t position, void* stripe_vptr)
+	{
+		hfs_stripe* stripe = (hfs_stripe*)stripe_vptr;
+		if (size == 0)
 		{
-			uint8_t magic = 0b01000000 >> (auth_level * 3);
-			header.attribute ^= magic;
-			header.attribute |= val ? magic : 0;
-			write(&header, HEADER_SIZE);
+			switch (*(uint8_t*)buffer)
+			{
+				case HFS_SEEK_SET:
+					return stripe->position = position;
+				case HFS_SEEK_CUR:
+					return stripe->position += position;
+				case HFS_SEEK_END:
+				{
+					// The smallest member limits how far the stripes reach.
+					uint64_t mirror_end = stripe->mirror_clusters * stripe->cluster_size;
+					uint64_t data_start = stripe->label_size + (stripe->mirror_clusters + stripe->rfe_mirror_clusters) * stripe->cluster_size;
+					size_t m_size = SIZE_MAX;
+					for (hfs_stripe_member& m : stripe->members)
+						m_size = std::min(m_size, m.write_fn(buffer, 0, 0, m.extra_args));
+					if (stripe->members.size() == 0)
+						m_size = 0;
+					if (m_size > data_start)
+						m_size = mirror_end + (m_size - data_start) * stripe->members.size();
+					else if (m_size > stripe->label_size + mirror_end)
+						m_size = mirror_end;
+					else
+						m_size = m_size > stripe->label_size ? m_size - stripe->label_size : 0;
+					return stripe->position = m_size + position;
+				}
+				default:
+					return position - 1;
+			}
 		}
-		void vol_set_write(int auth_level, int val)
+		return stripe_io(stripe, buffer, size, position, true);
+	}
+
+	void hfs_stripe_reset(void* stripe_vptr)
+	{
+		hfs_stripe* stripe = (hfs_stripe*)stripe_vptr;
+		for (hfs_stripe_member& m : stripe->members)
+			m.reset_file_fn(m.extra_args);
+		stripe->rfe_clusters.clear();
+		stripe->position = 0;
+		stripe->error = 0;
+		// The members keep their label
+		if (stripe->label_size)
+			stripe_write_labels(stripe);
+	}
+
+	void trace_record(hfs_trace* trace, uint8_t op, uint64_t position, uint64_t size)
+	{
+		if (!trace->file)
+			return;
+		hfs_trace_record record;
+		record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace->start).count();
+		record.position = position;
+		record.size = size;
+		record.op = op;
+		record.api = trace->api;
+		record.reserved = 0;
+		fwrite(&record, sizeof(record), 1, trace->file);
+	}
+
+	int32_t hfs_trace_open(hfs_trace* trace, const char* path)
+	{
+		trace->file = fopen(path, "wb");
+		if (!trace->file)
+			return ERR_TRACE_NO_FILE;
+		uint32_t signature = TRACE_SIGNATURE;
+		fwrite(&signature, sizeof(signature), 1, trace->file);
+		trace->start = std::chrono::steady_clock::now();
+		return 0;
+	}
+
+	void hfs_trace_close(hfs_trace* trace)
+	{
+		if (trace->file)
+			fclose(trace->file);
+		trace->file = nullptr;
+	}
+
+	size_t hfs_trace_read(void* buffer, size_t size, size_t position, void* trace_vptr)
+	{
+		hfs_trace* trace = (hfs_trace*)trace_vptr;
+		trace_record(trace, size ? TRACE_OP_READ : TRACE_OP_TELL, position, size);
+		return trace->read_fn(buffer, size, position, trace->extra_args);
+	}
+
+	size_t hfs_trace_write(void* buffer, size_t size, size_t position, void* trace_vptr)
+	{
+		hfs_trace* trace = (hfs_trace*)trace_vptr;
+		if (size == 0)
+			trace_record(trace, TRACE_OP_SEEK, position, *(uint8_t*)buffer);
+		else
+			trace_record(trace, TRACE_OP_WRITE, position, size);
+		return trace->write_fn(buffer, size, position, trace->extra_args);
+	}
+
+	void hfs_trace_reset(void* trace_vptr)
+	{
+		hfs_trace* trace = (hfs_trace*)trace_vptr;
+		trace_record(trace, TRACE_OP_RESET, 0, 0);
+		trace->reset_file_fn(trace->extra_args);
+	}
+
+	void hfs_trace_api(uint8_t api, uint64_t user_bytes, void* trace_vptr)
+	{
+		hfs_trace* trace = (hfs_trace*)trace_vptr;
+		trace->api = api;
+		trace_record(trace, TRACE_OP_API, 0, user_bytes);
+	}
+
+	// Re-executes a trace against a backend in order, as fast as the backend allows.
+	int32_t hfs_replay(const char* path, std::function<size_t(void*, size_t, size_t, void*)> read_fn, std::function<size_t(void*, size_t, size_t, void*)> write_fn, std::function<void(void*)> reset_file_fn, void* extra_args, hfs_replay_stats* stats)
+	{
+		memset(stats, 0, sizeof(hfs_replay_stats));
+		FILE* file = fopen(path, "rb");
+		if (!file)
+			return ERR_TRACE_NO_FILE;
+		uint32_t signature = 0;
+		if (fread(&signature, sizeof(signature), 1, file) != 1 || signature != TRACE_SIGNATURE)
 		{
-			uint8_t magic = 0b00100000 >> (auth_level * 3);
-			header.attribute ^= magic;
-			header.attribute |= val ? magic : 0;
-			write(&header, HEADER_SIZE);
+			fclose(file);
+			return ERR_TRACE_INVALID_SIGNATURE;
 		}
-		void vol_set_hidden(int val)
+		std::vector<uint8_t> buffer;
+		uint64_t last_end = 0;
+		hfs_trace_record record;
+		while (fread(&record, sizeof(record), 1, file) == 1)
 		{
-			uint8_t magic = header.attribute & 0b00000100;
-			header.attribute ^= magic;
-			header.attribute |= val ? magic : 0;
-			fseek(0, HFS_SEEK_SET);
-			write(&header, HEADER_SIZE);
+			stats->records++;
+			stats->traced_ns = record.timestamp;
+			if (record.op == TRACE_OP_API)
+			{
+				if (record.api == HFS_API_READ_BUFF || record.api == HFS_API_WRITE_BUFF)
+					stats->user_bytes += record.size;
+				continue;
+			}
+			if (record.op == TRACE_OP_READ || record.op == TRACE_OP_WRITE)
+			{
+				if (buffer.size() < record.size)
+					buffer.resize(record.size);
+				uint64_t distance = record.position > last_end ? record.position - last_end : last_end - record.position;
+				stats->distance[distance ? 64 - __builtin_clzll(distance) : 0]++;
+				last_end = record.position + record.size;
+			}
+			uint8_t mode = record.size;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			switch (record.op)
+			{
+				case TRACE_OP_READ:
+					read_fn(buffer.data(), record.size, record.position, extra_args);
+					stats->reads++;
+					stats->read_bytes += record.size;
+					break;
+				case TRACE_OP_WRITE:
+					write_fn(buffer.data(), record.size, record.position, extra_args);
+					stats->writes++;
+					stats->write_bytes += record.size;
+					break;
+				case TRACE_OP_SEEK:
+					write_fn(&mode, 0, record.position, extra_args);
+					stats->seeks++;
+					break;
+				case TRACE_OP_TELL:
+					read_fn(nullptr, 0, 0, extra_args);
+					break;
+				case TRACE_OP_RESET:
+					reset_file_fn(extra_args);
+					break;
+			}
+			stats->replay_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
 		}
-	};
+		fclose(file);
+		return 0;
+	}
 }
 
 // Example of RW functions with file_vptr being a pointer to an std::fstream
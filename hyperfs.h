@@ -24,21 +24,38 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define CLUSTER_CHAIN_SIZE 8
 #define CLUSTER_END (uint64_t)0x0000000000000000
 #define CLUSTER_END_NUB (uint64_t)0x0000000000000001 // NoUsedBytes
+#define CLUSTER_NARROW_MAX 0x10000 // Largest cluster a 16 bit used_bytes can describe, anything bigger needs HEADER_FEATURE_WIDE_CLUSTER
+#define CHECKSUM_BLOCK_SIZE CLUSTER_MULTIPLIER // HEADER_FEATURE_CHECKSUM: Clusters carry one CRC32C per block so an access only reads and writes the blocks it touches.
 
 #define HEADER_NOREAD_SIGNATURE (uint32_t)0x4E4F5244 // ASCII "NORD"
 #define HEADER_NOREAD_LSB_SIGNATURE (uint32_t)0x44524F4E // ASCII "DRON"
 #define HEADER_DIRECTION_SIGN (uint16_t)0x55AA // 0b0101010110101010
 #define HEADER_SIZE (sizeof(hfs_header) - sizeof(uint8_t*)) // The actual cluster size after allocating the c_pad is header.cluster_size
-#define HEADER_PADDING_SIZE 456
+#define HEADER_PADDING_SIZE 428
+#define HEADER_VERSION_0 0
+#define HEADER_VERSION_1 1 // In version 1 the reserved segment holds HEADER_FEATURE_* flags instead of 0xFF.
+
+#define HEADER_FEATURE_INLINE (uint8_t)0b00000001 // Small files are packed into shared inline clusters.
+#define HEADER_FEATURE_WIDE_CLUSTER (uint8_t)0b00000010 // Data cluster trailers use a 64 bit used_bytes, allowing clusters of any CLUSTER_MULTIPLIER multiple.
+#define HEADER_FEATURE_CHECKSUM (uint8_t)0b00000100 // The header carries a CRC32C, RFE chain and data clusters one per CHECKSUM_BLOCK_SIZE block. They are verified whenever they are read.
+#define HEADER_FEATURES_SUPPORTED (HEADER_FEATURE_INLINE | HEADER_FEATURE_WIDE_CLUSTER | HEADER_FEATURE_CHECKSUM)
+
+#define INLINE_RECORD_HEADER_SIZE 4
+#define INLINE_RECORD_MAX 1024 // Largest inline record (header + capacity), files growing past it are moved into their own cluster.
+#define INLINE_RECORD_ALIGN 16 // Also the smallest capacity, a freed record keeps the offset of the next free record in its payload.
+#define INLINE_RECORD_FREE (uint16_t)0xFFFF // used_bytes of a freed inline record
+#define INLINE_FREE_SCAN 8 // Free records looked at by an inline allocation before a new record is taken from inline_cluster
 
 //struct data_cluster // CLUSTER_SIZE (Size varies by cluster size)
 //{
 //	uint8_t data[CLUSTER_SIZE - CLUSTER_CHAIN_SIZE - 2];
+//	uint32_t checksum[CLUSTER_SIZE / CHECKSUM_BLOCK_SIZE]; // HEADER_FEATURE_CHECKSUM only: CRC32C of every block of the cluster, the bytes of this table are left out.
 //	uint16_t used_bytes; // Bytes used by file in cluster overridden if next_cluster is not CLUSTER_END or is CLUSTER_END_NUB as that means that the used bytes is the entire cluster.
+//						 // uint64_t with HEADER_FEATURE_WIDE_CLUSTER, where it's always exact and CLUSTER_END_NUB is never used.
 //	uint64_t next_cluster; // Points to next cluster. If last cluster then it's set to CLUSTER_END or CLUSTER_END_NUB because CLUSTER_END points to the header and CLUSTER_END_NUB points to the first rfe chain.
 //}__attribute__((packed));
 
-struct hfs_header // 512 bytes (however CLUSTER_SIZE are written in total) 55 + padding[456] + boot_sig (2)
+struct hfs_header // 512 bytes (however CLUSTER_SIZE are written in total) 55 + padding[428] + inline_free (8) + checksum (4) + inline[16] + boot_sig (2)
 {
 	uint32_t signature; // If the signature is "NORD" then it shouldn't be read (such as a boot drive)
 	uint8_t direction_b01; // Set to 0x55 0xAA (MSB 55 LSB AA) so that the driver would know if the header and file entry are written in MSB or LSB format.
@@ -51,9 +68,13 @@ struct hfs_header // 512 bytes (however CLUSTER_SIZE are written in total) 55 +
 	uint8_t attribute; // LONG NAME (LN) | USER READ (UR) | USER WRITE (UW) | ROOT READ (RR) | ROOT WRITE (RW) | HIDDEN (H) | 2 BIT VERSION (V) // Example: (Norm: 01111000, URO: 01011000, UNA: 00011000, UNAH: 00011100)
 	uint16_t creation_date; // 15-9: Year (0: 2024, 2151) 8-5: Month (1-12) 4-0: Day (1-31) | EG: 2024/1/24 0000000|0000|11000
 	uint8_t owner_id;
-	uint8_t reserved; // Could be used in later versions. In version 0 it's always 0xFF
+	uint8_t reserved; // In version 0 it's always 0xFF. In version 1 it contains the HEADER_FEATURE_* flags of the volume.
 	uint64_t clusters;
-	uint8_t padding[HEADER_PADDING_SIZE]; // 456
+	uint8_t padding[HEADER_PADDING_SIZE]; // 428
+	uint64_t inline_free; // HEADER_FEATURE_INLINE: Byte offset of the first freed hfs_inline_record, CLUSTER_END if none. Part of the padding (zero) in version 0.
+	uint32_t checksum; // HEADER_FEATURE_CHECKSUM: CRC32C of the header (HEADER_SIZE bytes) without this field. Part of the padding (zero) in version 0.
+	uint64_t inline_cluster; // HEADER_FEATURE_INLINE: Cluster currently being filled with inline records, CLUSTER_END if none. Part of the padding (zero) in version 0.
+	uint64_t inline_used; // HEADER_FEATURE_INLINE: Bytes of inline_cluster taken by inline records.
 	uint8_t boot_sig_0; // If bootable then it's set to 0x55AA, if not the anything else other than zero.
 	uint8_t boot_sig_1; // If bootable then it's set to 0x55AA, if not the anything else other than zero.
 	// Extra padding to fill in the rest of the cluster
@@ -74,11 +95,52 @@ struct hfs_reserved_file_entry // 40 bytes, stored in reserved clusters with the
 	uint16_t modification_date; // EG: 2027/5/20 0000011|0100|10100
 	uint8_t owner_id;
 	uint8_t is_last_rfe;
-	uint64_t next_cluster; // Points to first cluster for file data.
+	uint64_t next_cluster; // Points to first cluster for file data. If cluster_size is 0 (HEADER_FEATURE_INLINE) it's the byte offset of the file's hfs_inline_record instead, CLUSTER_END if the file is empty.
 }__attribute__((packed));
 
 struct hfs_reserved_chain_entry // 24 bytes
 {
 	uint64_t next_rfe_chain; // if it doesn't point to an rfe_chain then CLUSTER_END
 	uint8_t reserved[16];
+	// HEADER_FEATURE_CHECKSUM: The entry slots right before it hold the block checksums of the RFE chain cluster, laid out like the data cluster table
+	// (one slot per 10 blocks), the chain entry itself stays at the same offset.
 };
+
+struct hfs_inline_record // 4 bytes + capacity, stored back to back in inline clusters (HEADER_FEATURE_INLINE)
+{						//	 inline clusters keep the cluster trailer free so they can be walked like data clusters.
+	uint16_t capacity; // Bytes reserved for the payload after this record header.
+	uint16_t used_bytes; // Bytes used by the file, INLINE_RECORD_FREE if the record is on the inline_free list.
+}__attribute__((packed));
+
+#define STRIPE_SIGNATURE (uint32_t)0x54534648 // ASCII "HFST" at the start of every member of an hfs_stripe
+
+struct hfs_stripe_label // 56 bytes + 8 per RFE slot, at the start of every member of an hfs_stripe (the rest of its last cluster is unused)
+{
+	uint32_t signature; // STRIPE_SIGNATURE
+	uint32_t members;
+	uint32_t member; // Index of the member holding this label
+	uint32_t reserved;
+	uint64_t cluster_size;
+	uint64_t stripe_clusters;
+	uint64_t mirror_clusters;
+	uint64_t rfe_mirror_clusters; // RFE slots, followed by as many uint64_t: the RFE chain cluster held by each slot
+	uint64_t slots_used;
+}__attribute__((packed));
+
+#define TRACE_SIGNATURE (uint32_t)0x52544648 // ASCII "HFTR" at the start of a trace file, followed by hfs_trace_record(s)
+#define TRACE_OP_READ 0
+#define TRACE_OP_WRITE 1
+#define TRACE_OP_SEEK 2 // size is the seek mode
+#define TRACE_OP_TELL 3
+#define TRACE_OP_RESET 4
+#define TRACE_OP_API 5 // A public function started, size is the amount of bytes requested by the user
+
+struct hfs_trace_record // 24 bytes, one per backend call
+{
+	uint64_t timestamp; // Nanoseconds since the trace was opened
+	uint64_t position;
+	uint32_t size;
+	uint8_t op; // TRACE_OP_*
+	uint8_t api; // hfs::HFS_API_* of the public function that issued the call
+	uint16_t reserved;
+}__attribute__((packed));
@@ -0,0 +1,188 @@
+/*
+hyperfs_async.h
+Contains an awaitable (C++20 coroutine) interface for a hyperfs file system driver, on top of the blocking backend.
+
+Copyright (C) 2024 Mdfx
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "hyperfs_def.h"
+
+namespace hfs
+{
+	// Runs a job on some thread, anything that can be called with an std::function<void()> works (an io_context, a fiber scheduler...)
+	typedef std::function<void(std::function<void()>)> hfs_executor;
+
+	// Minimal executor for programs that don't bring their own
+	struct hfs_thread_pool
+	{
+		std::vector<std::thread> threads;
+		std::deque<std::function<void()>> jobs;
+		std::mutex lock;
+		std::condition_variable wake;
+		bool stopping = false;
+
+		hfs_thread_pool(size_t thread_count)
+		{
+			for (size_t i = 0; i < thread_count; i++)
+			{
+				threads.emplace_back([this]()
+				{
+					while (true)
+					{
+						std::function<void()> job;
+						{
+							std::unique_lock<std::mutex> l(lock);
+							wake.wait(l, [this]() { return stopping || jobs.size() > 0; });
+							if (jobs.size() == 0)
+								return;
+							job = std::move(jobs.front());
+							jobs.pop_front();
+						}
+						job();
+					}
+				});
+			}
+		}
+		~hfs_thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> l(lock);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (std::thread& t : threads)
+				t.join();
+		}
+		void post(std::function<void()> job)
+		{
+			{
+				std::lock_guard<std::mutex> l(lock);
+				jobs.push_back(std::move(job));
+			}
+			wake.notify_one();
+		}
+		hfs_executor executor()
+		{
+			return [this](std::function<void()> job) { post(std::move(job)); };
+		}
+	};
+
+	// Awaitable front end of an hfs_object: co_await vol.read(fptr, buff, size, position)
+	// hfs_object isn't thread safe, so the operations of one volume are queued and run one after another on the executor while the awaiting
+	// coroutines stay suspended, then each of them is resumed through the executor. Operations of different volumes run in parallel.
+	// Only the awaiting thread is freed: the backend stays blocking, an operation holds an executor thread for as long as its read_fn/write_fn
+	// calls take, and one volume never has more than one operation in flight however many are awaited.
+	struct hfs_async_volume
+	{
+		hfs_object* vol;
+		hfs_executor executor;
+
+		std::mutex lock;
+		std::deque<std::function<void()>> queue;
+		bool running = false;
+
+		hfs_async_volume(hfs_object* vol, hfs_executor executor) : vol(vol), executor(executor) {}
+
+		void submit(std::function<void()> job)
+		{
+			{
+				std::lock_guard<std::mutex> l(lock);
+				queue.push_back(std::move(job));
+				if (running)
+					return;
+				running = true;
+			}
+			executor([this]() { drain(); });
+		}
+		void drain()
+		{
+			while (true)
+			{
+				std::function<void()> job;
+				{
+					std::lock_guard<std::mutex> l(lock);
+					if (queue.size() == 0)
+					{
+						running = false;
+						return;
+					}
+					job = std::move(queue.front());
+					queue.pop_front();
+				}
+				job();
+			}
+		}
+
+		template<typename T>
+		struct op
+		{
+			hfs_async_volume* async_vol;
+			std::function<T()> fn;
+			T result = T();
+
+			bool await_ready()
+			{
+				return false;
+			}
+			void await_suspend(std::coroutine_handle<> handle)
+			{
+				async_vol->submit([this, handle]()
+				{
+					result = fn();
+					async_vol->executor([handle]() { handle.resume(); });
+				});
+			}
+			T await_resume()
+			{
+				return result;
+			}
+		};
+
+		// Name is 12 bytes; Extention is 4 bytes; Resumes with the fptr, 0 when failed.
+		op<uint64_t> open(uint8_t* name, uint8_t* extention)
+		{
+			return op<uint64_t>{this, [this, name, extention]() { return vol->lock_file(name, extention); }};
+		}
+		op<int32_t> close(uint64_t fptr)
+		{
+			return op<int32_t>{this, [this, fptr]() { return vol->unlock_file(fptr); }};
+		}
+		op<int32_t> create(uint8_t* name, uint8_t* extention, uint8_t attribute, uint8_t owner_id)
+		{
+			return op<int32_t>{this, [this, name, extention, attribute, owner_id]() { return vol->add_file(name, extention, attribute, owner_id); }};
+		}
+		op<int32_t> read(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth = 0)
+		{
+			return op<int32_t>{this, [this, fptr, buffer, size, position, depth]() { return vol->read_buff(fptr, buffer, size, position, depth); }};
+		}
+		op<int32_t> write(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth = 0, int ex_buff = 0)
+		{
+			return op<int32_t>{this, [this, fptr, buffer, size, position, depth, ex_buff]() { return vol->write_buff(fptr, buffer, size, position, depth, ex_buff); }};
+		}
+		op<int32_t> defrag(uint64_t io_budget, hfs_frag_stats* before, hfs_frag_stats* after)
+		{
+			return op<int32_t>{this, [this, io_budget, before, after]() { return vol->defrag(io_budget, before, after); }};
+		}
+	};
+}
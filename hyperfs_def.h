@@ -1,6 +1,11 @@
 #pragma once
 #include <stdint.h>
 #include <functional>
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+#include "hyperfs.h"
 
 namespace hfs
 {
@@ -12,17 +17,36 @@ namespace hfs
 	const int32_t			ERR_HEADER_UNSUPPORTED_VERSION = -6; //HED_VER
 	const int32_t		ERR_HEADER_NON_FF_RESERVED_SEGMENT = -7; //HED_RSF
 	const int32_t				  ERR_HEADER_ZERO_BOOT_SIG = -8; //HED_ZBS
+	// const int32_t		  ERR_HEADER_PADDING_TOO_SHORT = -9; // INVALID! Would cause HED_ZBS
 	const int32_t			 ERR_RFE_INVALID_PRESV_SEGMENT = -9; //RFE_PRS
 	const int32_t							ERR_RFE_NO_END = -10;//RFE_NED
 	const int32_t						 ERR_DATA_NO_SPACE = -11;//DTA_NSP
 	const int32_t					   ERR_FILE_NOT_LOCKED = -12;//FIL_NLK
 	const int32_t				 ERR_FILE_BUFFER_TOO_LARGE = -13;//FIL_BTL
 	const int32_t				  ERR_FILE_DEPTH_TOO_LARGE = -14;//FIL_DTL
+	const int32_t			ERR_HEADER_UNSUPPORTED_FEATURE = -15;//HED_FEA
+	const int32_t						 ERR_TRACE_NO_FILE = -16;//TRC_NFL
+	const int32_t			   ERR_TRACE_INVALID_SIGNATURE = -17;//TRC_SIG
+	const int32_t					  ERR_CLUSTER_CHECKSUM = -18;//CHK_MIS
+	const int32_t						ERR_STRIPE_INVALID = -19;//STR_INV
 
 	const uint8_t HFS_SEEK_SET = 0;
 	const uint8_t HFS_SEEK_CUR = 1;
 	const uint8_t HFS_SEEK_END = 2;
 
+	// Public functions reported through hfs_object::api_fn
+	const uint8_t HFS_API_NONE = 0;
+	const uint8_t HFS_API_PARSE = 1;
+	const uint8_t HFS_API_FORMAT = 2;
+	const uint8_t HFS_API_ADD_FILE = 3;
+	const uint8_t HFS_API_LOCK_FILE = 4;
+	const uint8_t HFS_API_WRITE_BUFF = 5;
+	const uint8_t HFS_API_READ_BUFF = 6;
+	const uint8_t HFS_API_FRAG_STATS = 7;
+	const uint8_t HFS_API_DEFRAG = 8;
+	const uint8_t HFS_API_F_SET = 9;
+	const uint8_t HFS_API_VOL_SET = 10;
+
 	struct date
 	{
 		date()
@@ -43,6 +67,69 @@ namespace hfs
 		uint8_t day;
 	};
 
+	// CRC32C, crc is the value returned by the previous call or 0 to start. Uses the SSE4.2 crc32 instruction when available.
+	uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+	struct hfs_frag_stats
+	{
+		uint64_t files; // Files stored in data clusters
+		uint64_t clusters; // Data clusters used by those files
+		uint64_t fragments; // Contiguous runs of clusters, equal to files when nothing is fragmented
+	};
+
+	// Who references each allocated cluster, built by map_clusters for defragmentation
+	struct hfs_cluster_map
+	{
+		std::vector<uint64_t> pred; // CMAP_FREE, CMAP_PINNED, CMAP_RFE | rfe index or the previous cluster in the chain
+		std::vector<uint64_t> next;
+		uint64_t allocated = 0; // Clusters in use when the map was built, pred and next have one more slot for the scratch cluster
+	};
+
+	// Where defrag() stopped, kept between calls until the layout of the volume changes (hfs_object::layout_gen)
+	struct hfs_defrag_state
+	{
+		hfs_cluster_map map;
+		std::vector<uint64_t> chain;
+		std::vector<uint8_t> run; // DEFRAG_RUN_BYTES of clusters being moved
+		uint64_t layout_gen = 0;
+		uint64_t file = 0; // RFE index of the next file to defragment
+		uint64_t cursor = 0; // First cluster after the runs placed so far
+		uint64_t skipped = 0; // Fragmented files of this pass that didn't fit in front of the end of the allocated clusters
+		int valid = false;
+	};
+
+	const uint64_t RFE_TABLE_BLOCK = 256; // Entries per hfs_rfe_block, 10 KiB of hfs_reserved_file_entry
+
+	struct hfs_rfe_block
+	{
+		hfs_reserved_file_entry entries[RFE_TABLE_BLOCK];
+		uint64_t offsets[RFE_TABLE_BLOCK]; // Byte offset of the entry on the volume
+		uint8_t locked[RFE_TABLE_BLOCK];
+	};
+
+	// In-memory RFE table of a volume. Entries are kept back to back in blocks that are only freed by release(), so clearing and refilling
+	// the table (read_rfe_chain) doesn't allocate once it has grown to the size of the RFE chain, and an entry never moves while the table grows.
+	// Lock flags and on-volume offsets live next to the entries and are indexed the same way (fptr - 1), lock flags survive clear().
+	struct hfs_rfe_table
+	{
+		std::vector<hfs_rfe_block*> blocks;
+		uint64_t count = 0;
+
+		hfs_rfe_table();
+		hfs_rfe_table(const hfs_rfe_table&) = delete;
+		hfs_rfe_table& operator=(const hfs_rfe_table&) = delete;
+		~hfs_rfe_table();
+
+		hfs_reserved_file_entry& operator[](uint64_t index);
+		uint64_t& offset(uint64_t index);
+		uint64_t size();
+		void clear();
+		void push_back(const hfs_reserved_file_entry& h_rfe, uint64_t offset);
+		int is_locked(uint64_t index);
+		void set_locked(uint64_t index, int val);
+		void release();
+	};
+
 	struct hfs_object
 	{
 		// Buffer, size, position, extra_args
@@ -55,26 +142,44 @@ namespace hfs
 		std::function<size_t(void*, size_t, size_t, void*)> write_fn;
 		// extra_args
 		// Truncates file.
-		std::function<void(void*)> reset_fn();
+		std::function<void(void*)> reset_file_fn;
+		// Api, user_bytes, extra_args
+		// Optional, called when a public function starts. See hfs_trace_api.
+		std::function<void(uint8_t, uint64_t, void*)> api_fn;
 
 		void* extra_args;
+		hfs_header header;
+		hfs_rfe_table rfe; // Also holds which files are locked
+		size_t position;
+		uint8_t* c_buff; // One cluster of scratch space, holds the blocks read or written with HEADER_FEATURE_CHECKSUM
+		uint64_t c_buff_size;
+		uint64_t io_bytes = 0; // Bytes passed to read_fn/write_fn, defrag's I/O budget is counted in them
+		uint64_t layout_gen = 0; // Changed whenever clusters are allocated or the RFE chain is rewritten
+		hfs_defrag_state defrag_state;
 
-		int no_read;
-		int bootable;
+		int no_read = false;
+		int bootable = false;
 
 		int32_t init();
 		int uninit();
 		int32_t parse();
-		// Name is 12 bytes;
-		int format(uint64_t cluster_size, uint64_t clusters, uint32_t signature, uint8_t* name, uint8_t attributes, uint8_t owner_id, uint8_t boot_sig_0, uint8_t boot_sig_1, uint8_t lname_len, uint8_t* lname);
-		// Name is 12 bytes; Extention is 4 bytes;
+		// Name is 12 bytes; Features are HEADER_FEATURE_* flags, any feature formats a version 1 volume.
+		int format(uint64_t cluster_size, uint64_t clusters, uint32_t signature, uint8_t* name, uint8_t attributes, uint8_t owner_id, uint8_t boot_sig_0, uint8_t boot_sig_1, uint8_t lname_len, uint8_t* lname, uint8_t features = 0);
+		// Name is 12 bytes; Extention is 4 bytes; With HEADER_FEATURE_INLINE files without a long name are stored inline until they outgrow INLINE_RECORD_MAX.
 		int32_t add_file(uint8_t* name, uint8_t* extention, uint8_t attribute, uint8_t owner_id);
 		// Returns 0 when failed.
 		uint64_t lock_file(uint8_t* name, uint8_t* extention);
 		int32_t unlock_file(uint64_t fptr);
-		// Buffer max size is cluster_size - position - 10 // Depth: How many next_cluster chains will it seek before writing // Ex_buff: adds an extra buffer and seeks to it before writing (unless size is 0)
+		int is_locked(uint64_t fptr);
+		// Buffer max size is cluster_size - position - 10 (16 with HEADER_FEATURE_WIDE_CLUSTER, +4 per CHECKSUM_BLOCK_SIZE with HEADER_FEATURE_CHECKSUM) // Depth: How many next_cluster chains will it seek before writing // Ex_buff: adds an extra buffer and seeks to it before writing (unless size is 0)
 		int32_t write_buff(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth, int ex_buff);
+		// With HEADER_FEATURE_CHECKSUM the trailer of every cluster on the way and the blocks read are verified, ERR_CLUSTER_CHECKSUM if one is damaged.
 		int32_t read_buff(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth);
+		int32_t frag_stats(hfs_frag_stats* stats);
+		// Moves fragmented chains into contiguous runs, stopping before the backend I/O of the call would pass io_budget bytes (one step is always made).
+		// before/after may be nullptr. Returns 1 if it has to be called again, 2 if the pass finished with files left fragmented (no free run before
+		// the end of the allocated clusters could hold them, after->fragments tells how many fragments are left).
+		int32_t defrag(uint64_t io_budget, hfs_frag_stats* before, hfs_frag_stats* after);
 		// auth_level 0 = user 1 = root/owner
 		int f_can_read(uint64_t fptr, int auth_level);
 		int f_can_write(uint64_t fptr, int auth_level);
@@ -103,5 +208,143 @@ namespace hfs
 		void vol_set_read(int auth_level, int val);
 		void vol_set_write(int auth_level, int val);
 		void vol_set_hidden(int val);
+
+		// Used by the functions above
+		void enter(uint8_t api, uint64_t user_bytes);
+		void read(void* buffer, size_t size);
+		void write(void* buffer, size_t size);
+		size_t ftell();
+		size_t fseek(size_t pos, uint8_t mode);
+		int has_feature(uint8_t feature);
+		void alloc_scratch();
+		uint32_t header_checksum();
+		void write_header();
+		uint64_t trailer_size();
+		uint64_t used_bytes_offset();
+		uint64_t rce_offset();
+		uint64_t rfes_per_cluster();
+		uint64_t read_used_bytes();
+		void write_used_bytes(uint64_t used_bytes);
+		uint64_t get_used_bytes(uint8_t* buff);
+		void set_used_bytes(uint8_t* buff, uint64_t used_bytes);
+		uint64_t checksum_blocks();
+		uint64_t checksum_offset(int is_rfe);
+		uint32_t block_checksum(uint8_t* buff, uint64_t block, uint64_t table);
+		int32_t verify_blocks(uint8_t* buff, int is_rfe, uint64_t first, uint64_t last);
+		void seal_blocks(uint8_t* buff, int is_rfe, uint64_t first, uint64_t last);
+		int32_t verify_cluster(uint8_t* buff, int is_rfe);
+		void seal_cluster(uint8_t* buff, int is_rfe);
+		int32_t read_cluster(uint64_t cluster, uint8_t* buff, int is_rfe);
+		void write_cluster(uint64_t cluster, uint8_t* buff, int is_rfe);
+		int32_t load_blocks(uint64_t cluster, uint64_t offset, uint64_t size, int is_rfe, int only_edges);
+		void store_blocks(uint64_t cluster, uint64_t offset, uint64_t size, int is_rfe);
+		int32_t fetch_cluster(uint64_t cluster, uint64_t offset, void* buffer, uint64_t size, int is_rfe);
+		int32_t patch_cluster(uint64_t cluster, uint64_t offset, void* buffer, uint64_t size, int is_rfe);
+		void write_new_cluster(uint64_t cluster, void* buffer, uint64_t size, uint64_t used_bytes);
+		int32_t read_rfe_chain();
+		int32_t write_rfe_chain();
+		int32_t write_rfe(uint64_t index);
+		uint64_t alloc_inline(uint16_t& capacity);
+		int is_inline_tail(uint64_t offset, uint16_t capacity);
+		int32_t free_inline(uint64_t offset, uint16_t capacity);
+		int32_t fetch_inline(uint64_t offset, uint8_t* record);
+		int32_t write_inline(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth, int ex_buff);
+		int32_t promote_inline(uint64_t fptr);
+		int32_t read_inline(uint64_t fptr, void* buffer, uint64_t size, uint64_t position, uint64_t depth);
+		int32_t walk_chain(uint64_t& cluster, uint64_t depth);
+		int32_t map_clusters(hfs_cluster_map& map);
+		void chain_of(hfs_cluster_map& map, uint64_t fptr, std::vector<uint64_t>& chain);
+		void frag_stats_of(hfs_cluster_map& map, hfs_frag_stats* stats);
+		int32_t redirect(uint64_t pred, uint64_t cluster);
+		int32_t relocate(hfs_cluster_map& map, uint64_t from, uint64_t to);
+		int32_t relocate_run(hfs_cluster_map& map, std::vector<uint64_t>& chain, uint64_t c, uint64_t to, uint64_t count);
+	};
+
+	struct hfs_stripe_member
+	{
+		std::function<size_t(void*, size_t, size_t, void*)> read_fn;
+		std::function<size_t(void*, size_t, size_t, void*)> write_fn;
+		std::function<void(void*)> reset_file_fn;
+
+		void* extra_args;
+	};
+
+	struct hfs_stripe_segment
+	{
+		size_t member; // SIZE_MAX if mirrored
+		size_t position; // Position on the member
+		size_t buff_offset;
+		size_t size;
 	};
+
+	struct hfs_stripe_workers;
+
+	// Presents several backends as one volume, hfs_stripe_read/hfs_stripe_write/hfs_stripe_reset are used as the hfs_object functions with the hfs_stripe as extra_args.
+	// Every member starts with an hfs_stripe_label holding the geometry and the RFE slot map. Then come the first mirror_clusters (the header and master
+	// RFEC), written to every member and read from the first one, and rfe_mirror_clusters slots that mirror the rest of the RFE chain, a slot per cluster
+	// in chain order. Every other cluster is distributed over the members stripe_clusters at a time.
+	// hfs_stripe_open has to be called first. Ranges spanning several members are transferred in parallel by one thread per member until hfs_stripe_close.
+	struct hfs_stripe
+	{
+		std::vector<hfs_stripe_member> members;
+		uint64_t cluster_size; // Has to match the cluster_size of the volume
+		uint64_t stripe_clusters = 16; // The geometry is only used for new members, hfs_stripe_open takes it from the label otherwise
+		uint64_t mirror_clusters = 2;
+		uint64_t rfe_mirror_clusters = 256; // About rfe_mirror_clusters * (cluster_size - 24) / 40 files
+		size_t position = 0;
+		int32_t error = 0; // ERR_STRIPE_INVALID once the RFE chain outgrew the slots, every write is refused from then on
+
+		uint64_t label_size = 0; // Bytes in front of every member taken by the label, whole clusters, 0 until hfs_stripe_open
+		std::vector<hfs_stripe_segment> segments; // Reused by every request
+		std::vector<uint64_t> rfe_clusters; // RFE chain clusters after the master RFEC, the index is the slot
+		std::vector<uint8_t> buff; // The label, or a cluster being moved into its slot
+		hfs_stripe_workers* workers = nullptr; // One thread per member, started by hfs_stripe_open
+	};
+
+	// Reads the labels of the members, or labels them if the first one has none, and starts a thread per member. Returns ERR_STRIPE_INVALID if
+	// there are no members, cluster_size/stripe_clusters is zero, mirror_clusters is under 2 or the labels don't agree with each other, the member
+	// count or cluster_size. hfs_stripe_close stops the threads.
+	int32_t hfs_stripe_open(hfs_stripe* stripe);
+	void hfs_stripe_close(hfs_stripe* stripe);
+	size_t hfs_stripe_read(void* buffer, size_t size, size_t position, void* stripe_vptr);
+	size_t hfs_stripe_write(void* buffer, size_t size, size_t position, void* stripe_vptr);
+	void hfs_stripe_reset(void* stripe_vptr);
+
+	// Wraps a backend and records every call made through it, use hfs_trace_read/hfs_trace_write/hfs_trace_reset as the hfs_object functions,
+	// hfs_trace_api as its api_fn and the hfs_trace as extra_args.
+	struct hfs_trace
+	{
+		std::function<size_t(void*, size_t, size_t, void*)> read_fn;
+		std::function<size_t(void*, size_t, size_t, void*)> write_fn;
+		std::function<void(void*)> reset_file_fn;
+
+		void* extra_args;
+
+		FILE* file = nullptr;
+		uint8_t api = HFS_API_NONE;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	struct hfs_replay_stats
+	{
+		uint64_t records;
+		uint64_t reads;
+		uint64_t writes;
+		uint64_t seeks;
+		uint64_t read_bytes;
+		uint64_t write_bytes;
+		uint64_t user_bytes; // Bytes requested through read_buff/write_buff
+		uint64_t traced_ns; // Duration of the traced session
+		uint64_t replay_ns; // Time spent in the backend during the replay
+		uint64_t distance[65]; // Reads/writes by distance from the end of the previous one, [0] sequential, [n] less than 2^n bytes away
+	};
+
+	int32_t hfs_trace_open(hfs_trace* trace, const char* path);
+	void hfs_trace_close(hfs_trace* trace);
+	size_t hfs_trace_read(void* buffer, size_t size, size_t position, void* trace_vptr);
+	size_t hfs_trace_write(void* buffer, size_t size, size_t position, void* trace_vptr);
+	void hfs_trace_reset(void* trace_vptr);
+	void hfs_trace_api(uint8_t api, uint64_t user_bytes, void* trace_vptr);
+	// Re-executes a trace against a backend in order, as fast as the backend allows.
+	int32_t hfs_replay(const char* path, std::function<size_t(void*, size_t, size_t, void*)> read_fn, std::function<size_t(void*, size_t, size_t, void*)> write_fn, std::function<void(void*)> reset_file_fn, void* extra_args, hfs_replay_stats* stats);
 }
@@ -0,0 +1,213 @@
+/*
+hfs_alloc_check.cpp
+Counts the heap allocations hyperfs makes while files are opened, written, read and closed once the volume is warmed up.
+
+Copyright (C) 2024 Mdfx
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <atomic>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+#include "../hyperfs_def.h"
+
+// Every allocation of the program and libhyperfs goes through these while counting is set
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+std::atomic<long> allocations{0};
+std::atomic<bool> counting{false};
+
+extern "C" void* malloc(size_t size)
+{
+	if (counting)
+		allocations++;
+	return __libc_malloc(size);
+}
+extern "C" void* calloc(size_t count, size_t size)
+{
+	if (counting)
+		allocations++;
+	return __libc_calloc(count, size);
+}
+extern "C" void* realloc(void* ptr, size_t size)
+{
+	if (counting)
+		allocations++;
+	return __libc_realloc(ptr, size);
+}
+extern "C" void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+
+struct ram_file
+{
+	std::vector<uint8_t> data;
+	size_t position = 0;
+};
+
+size_t ram_read(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+		return ram->position;
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(buff, ram->data.data() + position, size);
+	return ram->position = position + size;
+}
+size_t ram_write(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+	{
+		switch (*(uint8_t*)buff)
+		{
+			case hfs::HFS_SEEK_SET:
+				return ram->position = position;
+			case hfs::HFS_SEEK_CUR:
+				return ram->position += position;
+			case hfs::HFS_SEEK_END:
+				return ram->position = ram->data.size() + position;
+			default:
+				return position - 1;
+		}
+	}
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(ram->data.data() + position, buff, size);
+	return ram->position = position + size;
+}
+void ram_reset(void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	ram->data.clear();
+	ram->position = 0;
+}
+
+const uint64_t CLUSTER_SIZE = 4096;
+const uint64_t CLUSTERS = 1200;
+const int FILES = 600;
+const int FILE_SIZE = 2000; // One data cluster, write_buff doesn't chain clusters without ex_buff
+
+// Creates FILES files, then runs lock_file/write_buff/read_buff/unlock_file over all of them twice and returns the allocations of the second pass
+long steady_allocations(hfs::hfs_object* vol, uint8_t features)
+{
+	uint8_t vol_name[12] = "alloc";
+	if (vol->format(CLUSTER_SIZE, CLUSTERS, 0, vol_name, 0b01111000, 0, 1, 1, 0, nullptr, features) < 0 || vol->parse() < 0)
+		return -1;
+	uint8_t extention[4] = {'b', 'i', 'n', 0};
+	for (int i = 0; i < FILES; i++)
+	{
+		uint8_t name[12] = {0};
+		snprintf((char*)name, sizeof(name), "f%d", i);
+		if (vol->add_file(name, extention, 0b01111000, 0) < 0)
+			return -1;
+	}
+	std::vector<uint8_t> data(FILE_SIZE, 0x5A);
+	std::vector<uint8_t> back(FILE_SIZE);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		allocations = 0;
+		counting = pass == 1;
+		for (int i = 0; i < FILES; i++)
+		{
+			uint8_t name[12] = {0};
+			snprintf((char*)name, sizeof(name), "f%d", i);
+			uint64_t fptr = vol->lock_file(name, extention);
+			// On inline volumes the small files stay inline, the rest always go through data clusters
+			uint64_t size = i % 2 ? FILE_SIZE : 100;
+			if (fptr == 0 || vol->write_buff(fptr, data.data(), size, 0, 0, 0) < 0 || vol->read_buff(fptr, back.data(), size, 0, 0) < 0 || memcmp(data.data(), back.data(), size) || vol->unlock_file(fptr) < 0)
+			{
+				counting = false;
+				return -1;
+			}
+		}
+		counting = false;
+	}
+	return allocations;
+}
+
+int check(const char* label, uint8_t features, hfs::hfs_object* vol)
+{
+	long result = steady_allocations(vol, features);
+	vol->uninit();
+	if (result != 0)
+	{
+		if (result < 0)
+			printf("%s: volume operation failed\n", label);
+		else
+			printf("%s: %ld allocations in the steady pass\n", label, result);
+		return 1;
+	}
+	printf("%s: no allocations in the steady pass\n", label);
+	return 0;
+}
+
+int check_ram(const char* label, uint8_t features)
+{
+	ram_file ram;
+	ram.data.reserve(CLUSTER_SIZE * CLUSTERS);
+	hfs::hfs_object vol;
+	vol.read_fn = ram_read;
+	vol.write_fn = ram_write;
+	vol.reset_file_fn = ram_reset;
+	vol.extra_args = &ram;
+	vol.init();
+	return check(label, features, &vol);
+}
+
+int check_stripe(const char* label, uint8_t features)
+{
+	const int MEMBERS = 3;
+	ram_file ram[MEMBERS];
+	hfs::hfs_stripe stripe;
+	stripe.cluster_size = CLUSTER_SIZE;
+	stripe.stripe_clusters = 1;
+	for (int m = 0; m < MEMBERS; m++)
+	{
+		ram[m].data.reserve(CLUSTER_SIZE * CLUSTERS);
+		stripe.members.push_back({ram_read, ram_write, ram_reset, &ram[m]});
+	}
+	if (hfs::hfs_stripe_open(&stripe) < 0)
+	{
+		printf("%s: can't open the stripe\n", label);
+		return 1;
+	}
+	hfs::hfs_object vol;
+	vol.read_fn = hfs::hfs_stripe_read;
+	vol.write_fn = hfs::hfs_stripe_write;
+	vol.reset_file_fn = hfs::hfs_stripe_reset;
+	vol.extra_args = &stripe;
+	vol.init();
+	int result = check(label, features, &vol);
+	hfs::hfs_stripe_close(&stripe);
+	return result;
+}
+
+int main()
+{
+	int failed = 0;
+	failed += check_ram("plain", 0);
+	failed += check_ram("inline", HEADER_FEATURE_INLINE);
+	failed += check_ram("checksum", HEADER_FEATURE_CHECKSUM);
+	failed += check_ram("wide+inline+checksum", HEADER_FEATURE_WIDE_CLUSTER | HEADER_FEATURE_INLINE | HEADER_FEATURE_CHECKSUM);
+	failed += check_stripe("striped", HEADER_FEATURE_INLINE | HEADER_FEATURE_CHECKSUM);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,178 @@
+/*
+hfs_async_check.cpp
+Drives two RAM volumes through hyperfs_async.h from many coroutines at once and checks what they read back.
+
+Copyright (C) 2024 Mdfx
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+#include "../hyperfs_async.h"
+
+struct ram_file
+{
+	std::vector<uint8_t> data;
+	size_t position = 0;
+};
+
+size_t ram_read(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+		return ram->position;
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(buff, ram->data.data() + position, size);
+	return ram->position = position + size;
+}
+size_t ram_write(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+	{
+		switch (*(uint8_t*)buff)
+		{
+			case hfs::HFS_SEEK_SET:
+				return ram->position = position;
+			case hfs::HFS_SEEK_CUR:
+				return ram->position += position;
+			case hfs::HFS_SEEK_END:
+				return ram->position = ram->data.size() + position;
+			default:
+				return position - 1;
+		}
+	}
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(ram->data.data() + position, buff, size);
+	return ram->position = position + size;
+}
+void ram_reset(void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	ram->data.clear();
+	ram->position = 0;
+}
+
+// Fire and forget coroutine, runs until its first co_await right away
+struct task
+{
+	struct promise_type
+	{
+		task get_return_object()
+		{
+			return {};
+		}
+		std::suspend_never initial_suspend()
+		{
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+		void return_void() {}
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+};
+
+const int VOLUMES = 2;
+const int FILES = 64; // Per volume
+const int ROUNDS = 8;
+
+std::atomic<int> done{0};
+std::atomic<int> fails{0};
+
+task file_job(hfs::hfs_async_volume* vol, int id)
+{
+	uint8_t name[12] = {0};
+	uint8_t extention[4] = {'d', 'a', 't', 0};
+	snprintf((char*)name, sizeof(name), "f%d", id);
+	if (co_await vol->create(name, extention, 0b01111000, 0) < 0)
+		fails++;
+	uint64_t fptr = co_await vol->open(name, extention);
+	if (fptr == 0)
+		fails++;
+	else
+	{
+		for (int round = 0; round < ROUNDS; round++)
+		{
+			char data[64];
+			char back[64] = {0};
+			snprintf(data, sizeof(data), "file %d round %d", id, round);
+			if (co_await vol->write(fptr, data, sizeof(data), 0) < 0)
+				fails++;
+			if (co_await vol->read(fptr, back, sizeof(back), 0) < 0 || memcmp(data, back, sizeof(data)))
+				fails++;
+		}
+		if (co_await vol->close(fptr) < 0)
+			fails++;
+	}
+	done++;
+}
+
+int main()
+{
+	ram_file ram[VOLUMES];
+	hfs::hfs_object vol[VOLUMES];
+	for (int v = 0; v < VOLUMES; v++)
+	{
+		vol[v].read_fn = ram_read;
+		vol[v].write_fn = ram_write;
+		vol[v].reset_file_fn = ram_reset;
+		vol[v].extra_args = &ram[v];
+		vol[v].init();
+		uint8_t name[12] = "async";
+		if (vol[v].format(4096, FILES + 16, 0, name, 0b01111000, 0, 1, 1, 0, nullptr) < 0 || vol[v].parse() < 0)
+		{
+			printf("Can't format volume %d\n", v);
+			return 1;
+		}
+	}
+	std::vector<std::unique_ptr<hfs::hfs_async_volume>> async_vol;
+	{
+		// The pool goes first, a volume may still be finishing its queue when the last job is done
+		hfs::hfs_thread_pool pool(4);
+		for (int v = 0; v < VOLUMES; v++)
+			async_vol.emplace_back(new hfs::hfs_async_volume(&vol[v], pool.executor()));
+		for (int f = 0; f < FILES; f++)
+		{
+			for (int v = 0; v < VOLUMES; v++)
+				file_job(async_vol[v].get(), f);
+		}
+		std::chrono::steady_clock::time_point limit = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+		while (done < VOLUMES * FILES && std::chrono::steady_clock::now() < limit)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	for (int v = 0; v < VOLUMES; v++)
+		vol[v].uninit();
+	if (done != VOLUMES * FILES || fails)
+	{
+		printf("%d of %d jobs finished, %d failures\n", done.load(), VOLUMES * FILES, fails.load());
+		return 1;
+	}
+	printf("%d jobs on %d volumes finished\n", done.load(), VOLUMES);
+	return 0;
+}
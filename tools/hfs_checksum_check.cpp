@@ -0,0 +1,195 @@
+/*
+hfs_checksum_check.cpp
+Measures the backend I/O of small and full-cluster reads and writes with and without checksums, and damages single blocks to see what notices.
+
+Copyright (C) 2024 Mdfx
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+#include "../hyperfs_def.h"
+
+struct ram_file
+{
+	std::vector<uint8_t> data;
+	size_t position = 0;
+};
+
+size_t ram_read(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+		return ram->position;
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(buff, ram->data.data() + position, size);
+	return ram->position = position + size;
+}
+size_t ram_write(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+	{
+		switch (*(uint8_t*)buff)
+		{
+			case hfs::HFS_SEEK_SET:
+				return ram->position = position;
+			case hfs::HFS_SEEK_CUR:
+				return ram->position += position;
+			case hfs::HFS_SEEK_END:
+				return ram->position = ram->data.size() + position;
+			default:
+				return position - 1;
+		}
+	}
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(ram->data.data() + position, buff, size);
+	return ram->position = position + size;
+}
+void ram_reset(void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	ram->data.clear();
+	ram->position = 0;
+}
+
+const uint64_t SMALL = 4096; // Or an eighth of the cluster if that's less
+
+int fails = 0;
+
+void check(int ok, const char* what)
+{
+	if (!ok)
+	{
+		printf("  failed: %s\n", what);
+		fails++;
+	}
+}
+
+struct volume
+{
+	ram_file ram;
+	hfs::hfs_object vol;
+	uint64_t fptr = 0;
+	uint64_t full = 0; // Data bytes a cluster holds
+	std::vector<uint8_t> data;
+
+	// One file filling its first cluster
+	volume(uint64_t cluster_size, uint8_t features)
+	{
+		vol.read_fn = ram_read;
+		vol.write_fn = ram_write;
+		vol.reset_file_fn = ram_reset;
+		vol.extra_args = &ram;
+		vol.init();
+		uint8_t vol_name[12] = "checksum";
+		check(vol.format(cluster_size, 8, 0, vol_name, 0b01111000, 0, 1, 1, 0, nullptr, features) == 0 && vol.parse() == 0, "format");
+		uint8_t name[12] = "file";
+		uint8_t extention[4] = {'b', 'i', 'n', 0};
+		check(vol.add_file(name, extention, 0b01111000, 0) == 0, "add a file");
+		fptr = vol.lock_file(name, extention);
+		full = cluster_size - vol.trailer_size();
+		data.resize(full);
+		for (uint64_t i = 0; i < full; i++)
+			data[i] = i * 7;
+		check(fptr && vol.write_buff(fptr, data.data(), full, 0, 0, 0) == 0, "fill the cluster");
+	}
+	~volume()
+	{
+		vol.uninit();
+	}
+	uint8_t* cluster()
+	{
+		return ram.data.data() + vol.rfe[fptr - 1].next_cluster * vol.header.cluster_size;
+	}
+};
+
+// Backend bytes of a write_buff and a read_buff of size bytes at position
+void measure(volume& v, uint64_t size, uint64_t position, uint64_t& w_bytes, uint64_t& r_bytes)
+{
+	std::vector<uint8_t> back(size);
+	uint64_t start = v.vol.io_bytes;
+	check(v.vol.write_buff(v.fptr, v.data.data() + position, size, position, 0, 0) == 0, "write_buff");
+	w_bytes = v.vol.io_bytes - start;
+	start = v.vol.io_bytes;
+	check(v.vol.read_buff(v.fptr, back.data(), size, position, 0) == 0 && memcmp(back.data(), v.data.data() + position, size) == 0, "read_buff");
+	r_bytes = v.vol.io_bytes - start;
+}
+
+// A small access costs its own blocks, the trailer block and the RFE entry's block over a volume without checksums, a full one at most a cluster more
+void check_overhead(const char* label, uint64_t cluster_size, uint8_t features)
+{
+	printf("%s\n", label);
+	volume plain(cluster_size, features);
+	volume summed(cluster_size, features | HEADER_FEATURE_CHECKSUM);
+	uint64_t small = cluster_size / 8 < SMALL ? cluster_size / 8 : SMALL;
+	uint64_t small_w, small_r, full_w, full_r;
+	uint64_t s_small_w, s_small_r, s_full_w, s_full_r;
+	measure(plain, small, small, small_w, small_r);
+	measure(plain, plain.full, 0, full_w, full_r);
+	measure(summed, small, small, s_small_w, s_small_r);
+	measure(summed, summed.full, 0, s_full_w, s_full_r);
+	printf("  %llu B write_buff: %llu B, %llu B with checksums\n", (unsigned long long)small, (unsigned long long)small_w, (unsigned long long)s_small_w);
+	printf("  %llu B read_buff: %llu B, %llu B with checksums\n", (unsigned long long)small, (unsigned long long)small_r, (unsigned long long)s_small_r);
+	printf("  %llu B write_buff: %llu B, %llu B with checksums\n", (unsigned long long)plain.full, (unsigned long long)full_w, (unsigned long long)s_full_w);
+	printf("  %llu B read_buff: %llu B, %llu B with checksums\n", (unsigned long long)plain.full, (unsigned long long)full_r, (unsigned long long)s_full_r);
+	uint64_t table = cluster_size / CHECKSUM_BLOCK_SIZE * sizeof(uint32_t);
+	check(s_small_w <= small_w + 5 * CHECKSUM_BLOCK_SIZE + 3 * table, "small write_buff touches only its blocks");
+	check(s_small_r <= small_r + 2 * CHECKSUM_BLOCK_SIZE + table, "small read_buff touches only its blocks");
+	check(s_full_w <= full_w + 5 * CHECKSUM_BLOCK_SIZE + 3 * table, "full write_buff reads no block it overwrites");
+	check(s_full_r <= full_r + 2 * CHECKSUM_BLOCK_SIZE + table, "full read_buff reads the cluster once");
+}
+
+// Damage in a block is reported by every access reading that block and by no other one
+void check_damage(uint8_t features)
+{
+	printf("damaged blocks, features %d\n", features);
+	const uint64_t CLUSTER_SIZE = 4 * CHECKSUM_BLOCK_SIZE;
+	volume v(CLUSTER_SIZE, features | HEADER_FEATURE_CHECKSUM);
+	uint8_t back[16];
+	v.cluster()[CHECKSUM_BLOCK_SIZE + 5] ^= 0x40;
+	check(v.vol.read_buff(v.fptr, back, sizeof(back), 0, 0) == 0, "read from a sound block");
+	check(v.vol.read_buff(v.fptr, back, sizeof(back), CHECKSUM_BLOCK_SIZE, 0) == hfs::ERR_CLUSTER_CHECKSUM, "read from the damaged block");
+	check(v.vol.write_buff(v.fptr, back, sizeof(back), CHECKSUM_BLOCK_SIZE + 100, 0, 0) == hfs::ERR_CLUSTER_CHECKSUM, "partial write into the damaged block");
+	// Overwriting the whole block doesn't need what was in it
+	check(v.vol.write_buff(v.fptr, v.data.data() + CHECKSUM_BLOCK_SIZE, CHECKSUM_BLOCK_SIZE, CHECKSUM_BLOCK_SIZE, 0, 0) == 0, "overwrite the damaged block");
+	check(v.vol.read_buff(v.fptr, back, sizeof(back), CHECKSUM_BLOCK_SIZE, 0) == 0, "read from the rewritten block");
+	// The trailer block is verified by every access
+	v.cluster()[CLUSTER_SIZE - 1] ^= 0x40;
+	check(v.vol.read_buff(v.fptr, back, sizeof(back), 0, 0) == hfs::ERR_CLUSTER_CHECKSUM, "read with a damaged trailer");
+	// So is the block of the RFE entry a write updates
+	v.cluster()[CLUSTER_SIZE - 1] ^= 0x40;
+	uint64_t offset = v.vol.rfe.offset(v.fptr - 1);
+	v.ram.data[offset + 41] ^= 0x40;
+	check(v.vol.write_buff(v.fptr, back, sizeof(back), 0, 0, 0) == hfs::ERR_CLUSTER_CHECKSUM, "write with a damaged RFE block");
+}
+
+int main()
+{
+	check_overhead("4 KiB clusters", 4096, 0);
+	check_overhead("1 MiB clusters", 1 << 20, HEADER_FEATURE_WIDE_CLUSTER);
+	check_damage(0);
+	check_damage(HEADER_FEATURE_WIDE_CLUSTER);
+	if (fails)
+	{
+		printf("%d checks failed\n", fails);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+hfs_defrag_check.cpp
+Defragments RAM volumes laid out in ways that used to trip defrag up and checks every file afterwards.
+
+Copyright (C) 2024 Mdfx
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+#include "../hyperfs_def.h"
+
+struct ram_file
+{
+	std::vector<uint8_t> data;
+	size_t position = 0;
+};
+
+size_t ram_read(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+		return ram->position;
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(buff, ram->data.data() + position, size);
+	return ram->position = position + size;
+}
+size_t ram_write(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+	{
+		switch (*(uint8_t*)buff)
+		{
+			case hfs::HFS_SEEK_SET:
+				return ram->position = position;
+			case hfs::HFS_SEEK_CUR:
+				return ram->position += position;
+			case hfs::HFS_SEEK_END:
+				return ram->position = ram->data.size() + position;
+			default:
+				return position - 1;
+		}
+	}
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(ram->data.data() + position, buff, size);
+	return ram->position = position + size;
+}
+void ram_reset(void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	ram->data.clear();
+	ram->position = 0;
+}
+
+const uint64_t CLUSTER_SIZE = 4096;
+
+int fails = 0;
+
+void check(int ok, const char* what)
+{
+	if (!ok)
+	{
+		printf("  failed: %s\n", what);
+		fails++;
+	}
+}
+
+void open_volume(hfs::hfs_object* vol, ram_file* ram)
+{
+	vol->read_fn = ram_read;
+	vol->write_fn = ram_write;
+	vol->reset_file_fn = ram_reset;
+	vol->extra_args = ram;
+	vol->init();
+}
+
+int format_volume(hfs::hfs_object* vol, ram_file* ram, uint64_t clusters, uint8_t features)
+{
+	open_volume(vol, ram);
+	uint8_t vol_name[12] = "defrag";
+	return vol->format(CLUSTER_SIZE, clusters, 0, vol_name, 0b01111000, 0, 1, 1, 0, nullptr, features) < 0 || vol->parse() < 0 ? -1 : 0;
+}
+
+uint64_t create(hfs::hfs_object* vol, int id)
+{
+	uint8_t name[12] = {0};
+	uint8_t extention[4] = {'b', 'i', 'n', 0};
+	snprintf((char*)name, sizeof(name), "f%d", id);
+	if (vol->add_file(name, extention, 0b01111000, 0) < 0)
+		return 0;
+	return vol->lock_file(name, extention);
+}
+
+// Fills the cluster at depth of a file with a pattern of its id (file 0 is all 0xFF, like an unused record header), depth > 0 first appends a cluster
+int32_t fill(hfs::hfs_object* vol, uint64_t fptr, int id, uint64_t depth, uint64_t size)
+{
+	std::vector<uint8_t> data(size, (uint8_t)(0xFF - id * 16 - depth));
+	return vol->write_buff(fptr, data.data(), size, 0, depth ? depth - 1 : 0, depth ? 1 : 0);
+}
+
+int matches(hfs::hfs_object* vol, uint64_t fptr, int id, uint64_t depth, uint64_t size)
+{
+	std::vector<uint8_t> data(size, (uint8_t)(0xFF - id * 16 - depth));
+	std::vector<uint8_t> back(size);
+	return vol->read_buff(fptr, back.data(), size, 0, depth) == 0 && data == back;
+}
+
+int32_t defrag_all(hfs::hfs_object* vol, uint64_t io_budget, hfs::hfs_frag_stats* after)
+{
+	int32_t df_val;
+	int calls = 0;
+	do
+		df_val = vol->defrag(io_budget, nullptr, after);
+	while (df_val == 1 && ++calls < 10000);
+	return df_val;
+}
+
+// Inline records that were all freed leave a cluster that no file points into but the inline_free list does, it must not be reused
+void check_inline_free_list(uint8_t features)
+{
+	printf("inline free list, features %d\n", features);
+	ram_file ram;
+	hfs::hfs_object vol;
+	if (format_volume(&vol, &ram, 64, features) < 0)
+		return check(false, "format");
+	uint64_t fptr[7];
+	for (int i = 0; i < 6; i++)
+	{
+		fptr[i] = create(&vol, i);
+		check(fptr[i] && fill(&vol, fptr[i], i, 0, 1000) == 0, "write an inline file");
+	}
+	// Outgrown records go on the free list
+	for (int i = 0; i < 4; i++)
+		check(fill(&vol, fptr[i], i, 0, 4080) == 0, "promote an inline file");
+	hfs::hfs_frag_stats after;
+	check(defrag_all(&vol, UINT64_MAX, &after) == 0, "defrag");
+	fptr[6] = create(&vol, 6);
+	check(fptr[6] && fill(&vol, fptr[6], 6, 0, 100) == 0, "write a new inline file");
+	hfs::hfs_object reopened;
+	open_volume(&reopened, &ram);
+	check(reopened.parse() == 0, "parse");
+	for (int i = 0; i < 7; i++)
+	{
+		uint8_t name[12] = {0};
+		uint8_t extention[4] = {'b', 'i', 'n', 0};
+		snprintf((char*)name, sizeof(name), "f%d", i);
+		uint64_t r_fptr = reopened.lock_file(name, extention);
+		check(r_fptr && matches(&reopened, r_fptr, i, 0, i < 4 ? 4080 : i < 6 ? 1000 : 100), "file contents");
+	}
+	vol.uninit();
+	reopened.uninit();
+}
+
+// A file that can't be placed in front of the end of the allocated clusters isn't defragmented, and defrag has to say so
+void check_left_fragmented()
+{
+	printf("left fragmented\n");
+	ram_file ram;
+	hfs::hfs_object vol;
+	if (format_volume(&vol, &ram, 64, HEADER_FEATURE_INLINE) < 0)
+		return check(false, "format");
+	// a gets a data cluster, b's inline cluster follows it, then a grows past it
+	uint64_t a = create(&vol, 0);
+	check(a && fill(&vol, a, 0, 0, 4080) == 0, "write a");
+	uint64_t b = create(&vol, 1);
+	check(b && fill(&vol, b, 1, 0, 100) == 0, "write b");
+	check(fill(&vol, a, 0, 1, 100) == 0, "append to a");
+	hfs::hfs_frag_stats after;
+	check(defrag_all(&vol, UINT64_MAX, &after) == 2, "defrag reports the file it couldn't move");
+	check(after.fragments > after.files, "the file is still fragmented");
+	check(matches(&vol, a, 0, 0, 4080) && matches(&vol, a, 0, 1, 100) && matches(&vol, b, 1, 0, 100), "file contents");
+	vol.uninit();
+}
+
+// Interleaved files, defragmented with budgets down to a single step per call
+void check_interleaved(uint8_t features, uint64_t io_budget)
+{
+	printf("interleaved, features %d, budget %llu\n", features, (unsigned long long)io_budget);
+	const int FILES = 4;
+	const uint64_t CLUSTERS = 8;
+	ram_file ram;
+	hfs::hfs_object vol;
+	if (format_volume(&vol, &ram, 200, features) < 0)
+		return check(false, "format");
+	uint64_t fptr[FILES];
+	for (int i = 0; i < FILES; i++)
+	{
+		fptr[i] = create(&vol, i);
+		check(fptr[i] != 0, "create");
+	}
+	for (uint64_t c = 0; c < CLUSTERS; c++)
+	{
+		for (int i = 0; i < FILES; i++)
+			check(fill(&vol, fptr[i], i, c, 2000) == 0, "write");
+	}
+	hfs::hfs_frag_stats after;
+	int32_t df_val = defrag_all(&vol, io_budget, &after);
+	check(df_val == 0 || df_val == 2, "defrag");
+	check(df_val == 2 || after.fragments == after.files, "done means nothing is fragmented");
+	for (int i = 0; i < FILES; i++)
+	{
+		for (uint64_t c = 0; c < CLUSTERS; c++)
+			check(matches(&vol, fptr[i], i, c, 2000), "file contents");
+	}
+	vol.uninit();
+}
+
+int main()
+{
+	check_inline_free_list(HEADER_FEATURE_INLINE);
+	check_inline_free_list(HEADER_FEATURE_INLINE | HEADER_FEATURE_CHECKSUM);
+	check_left_fragmented();
+	uint8_t features[3] = {0, HEADER_FEATURE_INLINE | HEADER_FEATURE_CHECKSUM, HEADER_FEATURE_WIDE_CLUSTER};
+	for (uint8_t f : features)
+	{
+		check_interleaved(f, UINT64_MAX);
+		check_interleaved(f, 1);
+	}
+	if (fails)
+	{
+		printf("%d checks failed\n", fails);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*
+hfs_replay.cpp
+Replays a hyperfs backend trace against a RAM or file backend and reports what it cost.
+
+Copyright (C) 2024 Mdfx
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <fstream>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+#include "../hyperfs_def.h"
+
+struct ram_file
+{
+	std::vector<uint8_t> data;
+	size_t position = 0;
+};
+
+size_t ram_read(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+		return ram->position;
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(buff, ram->data.data() + position, size);
+	return ram->position = position + size;
+}
+size_t ram_write(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+	{
+		switch (*(uint8_t*)buff)
+		{
+			case hfs::HFS_SEEK_SET:
+				return ram->position = position;
+			case hfs::HFS_SEEK_CUR:
+				return ram->position += position;
+			case hfs::HFS_SEEK_END:
+				return ram->position = ram->data.size() + position;
+			default:
+				return position - 1;
+		}
+	}
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(ram->data.data() + position, buff, size);
+	return ram->position = position + size;
+}
+void ram_reset(void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	ram->data.clear();
+	ram->position = 0;
+}
+
+size_t file_read(void* buff, size_t size, size_t position, void* file_vptr)
+{
+	std::fstream* file = (std::fstream*)file_vptr;
+	if (size == 0)
+		return file->tellp();
+	file->clear();
+	file->seekp(position, std::ios::beg);
+	file->read((char*)buff, size);
+	file->clear();
+	return file->tellp();
+}
+size_t file_write(void* buff, size_t size, size_t position, void* file_vptr)
+{
+	std::fstream* file = (std::fstream*)file_vptr;
+	file->clear();
+	if (size == 0)
+	{
+		switch (*(uint8_t*)buff)
+		{
+			case hfs::HFS_SEEK_SET:
+				file->seekp(position, std::ios::beg);
+				return file->tellp();
+			case hfs::HFS_SEEK_CUR:
+				file->seekp(position, std::ios::cur);
+				return file->tellp();
+			case hfs::HFS_SEEK_END:
+				file->seekp(position, std::ios::end);
+				return file->tellp();
+			default:
+				return position - 1;
+		}
+	}
+	file->seekp(position, std::ios::beg);
+	file->write((char*)buff, size);
+	return file->tellp();
+}
+void file_reset(void* file_vptr)
+{
+	// Truncating an image isn't possible through fstream, formatting overwrites it anyway.
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("Usage: %s <trace> [image]\nReplays the trace against the image, or against memory if no image is given.\n", argv[0]);
+		return 1;
+	}
+	hfs::hfs_replay_stats stats;
+	int32_t r_val;
+	if (argc > 2)
+	{
+		std::fstream image(argv[2], std::ios::in | std::ios::out | std::ios::binary);
+		if (!image.is_open())
+			image.open(argv[2], std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!image.is_open())
+		{
+			printf("Can't open %s\n", argv[2]);
+			return 1;
+		}
+		r_val = hfs::hfs_replay(argv[1], file_read, file_write, file_reset, &image, &stats);
+	}
+	else
+	{
+		ram_file ram;
+		r_val = hfs::hfs_replay(argv[1], ram_read, ram_write, ram_reset, &ram, &stats);
+	}
+	if (r_val < 0)
+	{
+		printf("Can't replay %s (%d)\n", argv[1], r_val);
+		return 1;
+	}
+
+	uint64_t backend_bytes = stats.read_bytes + stats.write_bytes;
+	printf("records:       %lu\n", (unsigned long)stats.records);
+	printf("reads:         %lu (%lu bytes)\n", (unsigned long)stats.reads, (unsigned long)stats.read_bytes);
+	printf("writes:        %lu (%lu bytes)\n", (unsigned long)stats.writes, (unsigned long)stats.write_bytes);
+	printf("seeks:         %lu\n", (unsigned long)stats.seeks);
+	printf("user bytes:    %lu\n", (unsigned long)stats.user_bytes);
+	if (stats.user_bytes)
+		printf("amplification: %.2f backend bytes per user byte\n", (double)backend_bytes / stats.user_bytes);
+	printf("traced time:   %.3f ms\n", stats.traced_ns / 1e6);
+	printf("replay time:   %.3f ms\n", stats.replay_ns / 1e6);
+	printf("seek distance:\n");
+	for (int i = 0; i < 65; i++)
+	{
+		if (!stats.distance[i])
+			continue;
+		if (i == 0)
+			printf("  sequential   %lu\n", (unsigned long)stats.distance[i]);
+		else
+			printf("  < 2^%-2d       %lu\n", i, (unsigned long)stats.distance[i]);
+	}
+	return 0;
+}
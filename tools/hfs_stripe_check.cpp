@@ -0,0 +1,233 @@
+/*
+hfs_stripe_check.cpp
+Reopens striped RAM volumes with other settings and grows their RFE chain past the mirrored slots.
+
+Copyright (C) 2024 Mdfx
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+
+#include "../hyperfs_def.h"
+
+struct ram_file
+{
+	std::vector<uint8_t> data;
+	size_t position = 0;
+};
+
+size_t ram_read(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+		return ram->position;
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(buff, ram->data.data() + position, size);
+	return ram->position = position + size;
+}
+size_t ram_write(void* buff, size_t size, size_t position, void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	if (size == 0)
+	{
+		switch (*(uint8_t*)buff)
+		{
+			case hfs::HFS_SEEK_SET:
+				return ram->position = position;
+			case hfs::HFS_SEEK_CUR:
+				return ram->position += position;
+			case hfs::HFS_SEEK_END:
+				return ram->position = ram->data.size() + position;
+			default:
+				return position - 1;
+		}
+	}
+	if (position + size > ram->data.size())
+		ram->data.resize(position + size);
+	memcpy(ram->data.data() + position, buff, size);
+	return ram->position = position + size;
+}
+void ram_reset(void* ram_vptr)
+{
+	ram_file* ram = (ram_file*)ram_vptr;
+	ram->data.clear();
+	ram->position = 0;
+}
+
+const uint64_t CLUSTER_SIZE = 4096;
+const int MEMBERS = 3;
+
+int fails = 0;
+
+// With HEADER_FEATURE_CHECKSUM the last entry slot of a cluster holds its block checksums
+uint64_t rfes_per_cluster(uint8_t features)
+{
+	return (CLUSTER_SIZE - 24) / 40 - (features & HEADER_FEATURE_CHECKSUM ? 1 : 0);
+}
+
+void check(int ok, const char* what)
+{
+	if (!ok)
+	{
+		printf("  failed: %s\n", what);
+		fails++;
+	}
+}
+
+// order[i] is the RAM file used as member i
+void stripe_over(hfs::hfs_stripe* stripe, ram_file* ram, const int* order, int members)
+{
+	stripe->cluster_size = CLUSTER_SIZE;
+	for (int m = 0; m < members; m++)
+		stripe->members.push_back({ram_read, ram_write, ram_reset, &ram[order[m]]});
+}
+
+void open_volume(hfs::hfs_object* vol, hfs::hfs_stripe* stripe)
+{
+	vol->read_fn = hfs::hfs_stripe_read;
+	vol->write_fn = hfs::hfs_stripe_write;
+	vol->reset_file_fn = hfs::hfs_stripe_reset;
+	vol->extra_args = stripe;
+	vol->init();
+}
+
+int32_t add(hfs::hfs_object* vol, int id)
+{
+	uint8_t name[12] = {0};
+	uint8_t extention[4] = {'b', 'i', 'n', 0};
+	snprintf((char*)name, sizeof(name), "f%d", id);
+	int32_t af_val = vol->add_file(name, extention, 0b01111000, 0);
+	if (af_val < 0)
+		return af_val;
+	uint64_t fptr = vol->lock_file(name, extention);
+	if (fptr == 0)
+		return -1;
+	uint32_t data = id;
+	af_val = vol->write_buff(fptr, &data, sizeof(data), 0, 0, 0);
+	vol->unlock_file(fptr);
+	return af_val;
+}
+
+int matches(hfs::hfs_object* vol, int id)
+{
+	uint8_t name[12] = {0};
+	uint8_t extention[4] = {'b', 'i', 'n', 0};
+	snprintf((char*)name, sizeof(name), "f%d", id);
+	uint64_t fptr = vol->lock_file(name, extention);
+	uint32_t data = UINT32_MAX;
+	int ok = fptr && vol->read_buff(fptr, &data, sizeof(data), 0, 0) == 0 && data == (uint32_t)id;
+	if (fptr)
+		vol->unlock_file(fptr);
+	return ok;
+}
+
+// A stripe opened with other settings takes the geometry from the labels, members in the wrong order or missing are refused
+void check_reopen()
+{
+	printf("reopen\n");
+	const int FILES = 300;
+	ram_file ram[MEMBERS];
+	int order[MEMBERS] = {0, 1, 2};
+	{
+		hfs::hfs_stripe stripe;
+		stripe_over(&stripe, ram, order, MEMBERS);
+		stripe.stripe_clusters = 3;
+		stripe.rfe_mirror_clusters = 8;
+		check(hfs::hfs_stripe_open(&stripe) == 0, "open new members");
+		hfs::hfs_object vol;
+		open_volume(&vol, &stripe);
+		uint8_t vol_name[12] = "stripe";
+		check(vol.format(CLUSTER_SIZE, 1000, 0, vol_name, 0b01111000, 0, 1, 1, 0, nullptr, 0) == 0 && vol.parse() == 0, "format");
+		for (int i = 0; i < FILES; i++)
+			check(add(&vol, i) == 0, "add a file");
+		check(stripe.rfe_clusters.size() == FILES / rfes_per_cluster(0), "RFE chain clusters got slots");
+		hfs::hfs_stripe_close(&stripe);
+		vol.uninit();
+	}
+	{
+		hfs::hfs_stripe stripe;
+		stripe_over(&stripe, ram, order, MEMBERS);
+		check(hfs::hfs_stripe_open(&stripe) == 0, "open labelled members");
+		check(stripe.stripe_clusters == 3 && stripe.rfe_mirror_clusters == 8 && stripe.rfe_clusters.size() == FILES / rfes_per_cluster(0), "geometry and slots come from the label");
+		hfs::hfs_object vol;
+		open_volume(&vol, &stripe);
+		check(vol.parse() == 0, "parse");
+		for (int i = 0; i < FILES; i++)
+			check(matches(&vol, i), "file contents");
+		hfs::hfs_stripe_close(&stripe);
+		vol.uninit();
+	}
+	int swapped[MEMBERS] = {1, 0, 2};
+	hfs::hfs_stripe reordered;
+	stripe_over(&reordered, ram, swapped, MEMBERS);
+	check(hfs::hfs_stripe_open(&reordered) == hfs::ERR_STRIPE_INVALID, "members in the wrong order");
+	hfs::hfs_stripe missing;
+	stripe_over(&missing, ram, order, MEMBERS - 1);
+	check(hfs::hfs_stripe_open(&missing) == hfs::ERR_STRIPE_INVALID, "a missing member");
+}
+
+// Once every slot is taken the stripe refuses to link another RFE chain cluster, and the volume stays as it was before
+void check_slots_run_out(uint8_t features)
+{
+	printf("slots run out, features %d\n", features);
+	const uint64_t SLOTS = 4;
+	const int FILES = (SLOTS + 1) * rfes_per_cluster(features); // The master RFEC and every slot full
+	ram_file ram[MEMBERS];
+	int order[MEMBERS] = {0, 1, 2};
+	{
+		hfs::hfs_stripe stripe;
+		stripe_over(&stripe, ram, order, MEMBERS);
+		stripe.rfe_mirror_clusters = SLOTS;
+		check(hfs::hfs_stripe_open(&stripe) == 0, "open new members");
+		hfs::hfs_object vol;
+		open_volume(&vol, &stripe);
+		uint8_t vol_name[12] = "stripe";
+		check(vol.format(CLUSTER_SIZE, 2000, 0, vol_name, 0b01111000, 0, 1, 1, 0, nullptr, features) == 0 && vol.parse() == 0, "format");
+		for (int i = 0; i < FILES; i++)
+			check(add(&vol, i) == 0, "add a file");
+		check(stripe.error == 0, "no error while the slots last");
+		add(&vol, FILES);
+		check(stripe.error == hfs::ERR_STRIPE_INVALID, "the chain outgrew the slots");
+		check(stripe.rfe_clusters.size() == SLOTS, "no cluster past the slots");
+		hfs::hfs_stripe_close(&stripe);
+		vol.uninit();
+	}
+	hfs::hfs_stripe stripe;
+	stripe_over(&stripe, ram, order, MEMBERS);
+	check(hfs::hfs_stripe_open(&stripe) == 0, "open labelled members");
+	hfs::hfs_object vol;
+	open_volume(&vol, &stripe);
+	check(vol.parse() == 0, "parse");
+	for (int i = 0; i < FILES; i++)
+		check(matches(&vol, i), "file contents");
+	hfs::hfs_stripe_close(&stripe);
+	vol.uninit();
+}
+
+int main()
+{
+	check_reopen();
+	check_slots_run_out(0);
+	check_slots_run_out(HEADER_FEATURE_CHECKSUM);
+	if (fails)
+	{
+		printf("%d checks failed\n", fails);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}